@@ -0,0 +1,412 @@
+/*
+ * Copyright (c) 2012 Jeremy Pepper
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  * Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of message_queue nor the names of its contributors may
+ *    be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Throughput and latency benchmark. Each run pushes a fixed number of
+ * messages from a set of producer threads to a set of consumer threads, and
+ * reports messages per second and percentiles of the time from just before a
+ * message is written to just after it's read.
+ *
+ * Every option takes a comma-separated list of values, and every combination
+ * is run:
+ *
+ *   -p producers    number of producer threads (default 1,2,4)
+ *   -c consumers    number of consumer threads (default 1,2,4)
+ *   -s size         message size in bytes (default 16,256)
+ *   -d depth        queue depth (default 128,4096)
+ *   -r read         "block" (message_queue_read) or "poll"
+ *                   (message_queue_tryread) (default block,poll)
+ *   -a alloc        "on" to allocate and free every message, or "off" to have
+ *                   each producer recycle a fixed set of messages, which
+ *                   consumers hand back once they've read them
+ *                   (default on,off)
+ *   -m memory       where queue memory comes from: "default" (malloc),
+ *                   "local" (bound to the main thread's NUMA node), "thp"
+ *                   (transparent huge pages), "local-thp" (both),
+ *                   "hugetlb" (explicit huge pages) or "lazy" (mapped
+ *                   and committed on first use) (default default)
+ *   -S shards       number of shards, or 0 for an unsharded queue
+ *                   (default 0)
+ *   -n messages     messages per run (default 1000000)
+ *   -f format       "csv" or "json" (default csv)
+ */
+#include "../message_queue.h"
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_VALUES 16
+#define HISTOGRAM_SUB_BITS 4
+#define HISTOGRAM_BUCKETS (64 << HISTOGRAM_SUB_BITS)
+
+struct option_list {
+	int count;
+	int values[MAX_VALUES];
+};
+
+struct bench_config {
+	int producers, consumers, message_size, max_depth, blocking, alloc, memory, shards;
+	long messages;
+};
+
+struct bench_message {
+	uint64_t stamp;
+	long producer;
+	struct bench_message *next;
+};
+
+struct bench_result {
+	double seconds;
+	uint64_t p50, p99, p999;
+};
+
+/*
+ * Log-linear latency histogram: 2^HISTOGRAM_SUB_BITS buckets for every power
+ * of two, so each bucket is within about 6% of the values in it.
+ */
+struct histogram {
+	uint64_t buckets[HISTOGRAM_BUCKETS];
+	uint64_t count;
+};
+
+/*
+ * With -a off, consumers push messages they've read onto their producer's
+ * returned stack, and the producer takes the whole stack at once, so a
+ * message is only rewritten after it has been read.
+ */
+struct producer_state {
+	struct bench_message *returned;
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+struct consumer_state {
+	pthread_t thread;
+	struct histogram histogram;
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+static const int memory_flags[] = {
+	0,
+	MESSAGE_QUEUE_NUMA_LOCAL,
+	MESSAGE_QUEUE_HUGEPAGES,
+	MESSAGE_QUEUE_NUMA_LOCAL | MESSAGE_QUEUE_HUGEPAGES,
+	MESSAGE_QUEUE_HUGETLB,
+	MESSAGE_QUEUE_LAZY,
+};
+
+static struct message_queue queue;
+static struct bench_config config;
+static struct producer_state *producer_states;
+static pthread_barrier_t start_barrier;
+static long consumed __attribute__((aligned(CACHE_LINE_SIZE)));
+
+static inline uint64_t now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static inline int histogram_bucket(uint64_t value) {
+	if(value < (1 << HISTOGRAM_SUB_BITS))
+		return value;
+	int exponent = 63 - __builtin_clzll(value) - HISTOGRAM_SUB_BITS;
+	return ((exponent + 1) << HISTOGRAM_SUB_BITS) + ((value >> exponent) & ((1 << HISTOGRAM_SUB_BITS) - 1));
+}
+
+static inline uint64_t histogram_value(int bucket) {
+	if(bucket < (1 << HISTOGRAM_SUB_BITS))
+		return bucket;
+	int exponent = (bucket >> HISTOGRAM_SUB_BITS) - 1;
+	return ((uint64_t)((1 << HISTOGRAM_SUB_BITS) + (bucket & ((1 << HISTOGRAM_SUB_BITS) - 1))) << exponent);
+}
+
+static uint64_t histogram_percentile(struct histogram *histogram, double percentile) {
+	uint64_t target = histogram->count * percentile / 100, seen = 0;
+	for(int i=0;i<HISTOGRAM_BUCKETS;++i) {
+		seen += histogram->buckets[i];
+		if(seen > target)
+			return histogram_value(i);
+	}
+	return 0;
+}
+
+static void free_messages(struct bench_message *message) {
+	while(message) {
+		struct bench_message *next = message->next;
+		message_queue_message_free(&queue, message);
+		message = next;
+	}
+}
+
+static void give_back(struct bench_message *message) {
+	struct producer_state *state = &producer_states[message->producer];
+	struct bench_message *head = __atomic_load_n(&state->returned, __ATOMIC_RELAXED);
+	do {
+		message->next = head;
+	} while(!__atomic_compare_exchange_n(&state->returned, &head, message, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+static void *producer_threadproc(void *arg) {
+	long id = (long)arg;
+	long count = config.messages / config.producers + (id < config.messages % config.producers);
+	// Leave a message for each consumer's poison pill
+	int pool_size = (config.max_depth - config.consumers) / config.producers;
+	struct bench_message *spare = NULL;
+	if(pool_size < 1)
+		pool_size = 1;
+	if(!config.alloc) {
+		for(int i=0;i<pool_size;++i) {
+			struct bench_message *message = message_queue_message_alloc_blocking(&queue);
+			message->next = spare;
+			spare = message;
+		}
+	}
+	pthread_barrier_wait(&start_barrier);
+	for(long i=0;i<count;++i) {
+		struct bench_message *message;
+		if(config.alloc) {
+			message = message_queue_message_alloc_blocking(&queue);
+		} else {
+			while(!spare) {
+				spare = __atomic_exchange_n(&producer_states[id].returned, NULL, __ATOMIC_ACQUIRE);
+				if(!spare)
+					sched_yield();
+			}
+			message = spare;
+			spare = message->next;
+		}
+		message->producer = id;
+		message->stamp = now_ns();
+		message_queue_write(&queue, message);
+	}
+	free_messages(spare);
+	return NULL;
+}
+
+static void *consumer_threadproc(void *arg) {
+	struct consumer_state *state = arg;
+	pthread_barrier_wait(&start_barrier);
+	while(1) {
+		struct bench_message *message;
+		if(config.blocking) {
+			message = message_queue_read(&queue);
+		} else {
+			while(!(message = message_queue_tryread(&queue))) {
+				if(__atomic_load_n(&consumed, __ATOMIC_RELAXED) >= config.messages)
+					return NULL;
+				sched_yield();
+			}
+		}
+		if(message->producer < 0) {
+			message_queue_message_free(&queue, message);
+			return NULL;
+		}
+		uint64_t latency = now_ns() - message->stamp;
+		++state->histogram.buckets[histogram_bucket(latency)];
+		++state->histogram.count;
+		if(config.alloc)
+			message_queue_message_free(&queue, message);
+		else
+			give_back(message);
+		__sync_fetch_and_add(&consumed, 1);
+	}
+}
+
+static int run(struct bench_result *result) {
+	pthread_t *producers = malloc(sizeof(pthread_t) * config.producers);
+	struct consumer_state *consumers;
+	struct histogram total;
+	struct message_queue_size_class size_class = {config.message_size, config.max_depth};
+	struct message_queue_options options = {memory_flags[config.memory], 0};
+	uint64_t start;
+	if(!producers || posix_memalign((void **)&consumers, CACHE_LINE_SIZE, sizeof(*consumers) * config.consumers))
+		return -1;
+	if(posix_memalign((void **)&producer_states, CACHE_LINE_SIZE, sizeof(*producer_states) * config.producers))
+		return -1;
+	memset(consumers, 0, sizeof(*consumers) * config.consumers);
+	memset(producer_states, 0, sizeof(*producer_states) * config.producers);
+	if(message_queue_init_options(&queue, &size_class, 1, &options))
+		return -1;
+	if(config.shards && message_queue_enable_shards(&queue, config.shards)) {
+		message_queue_destroy(&queue);
+		return -1;
+	}
+	consumed = 0;
+	pthread_barrier_init(&start_barrier, NULL, config.producers + config.consumers + 1);
+	for(long i=0;i<config.producers;++i) {
+		pthread_create(&producers[i], NULL, &producer_threadproc, (void *)i);
+	}
+	for(int i=0;i<config.consumers;++i) {
+		pthread_create(&consumers[i].thread, NULL, &consumer_threadproc, &consumers[i]);
+	}
+	pthread_barrier_wait(&start_barrier);
+	start = now_ns();
+	for(int i=0;i<config.producers;++i) {
+		pthread_join(producers[i], NULL);
+	}
+	while(__atomic_load_n(&consumed, __ATOMIC_RELAXED) < config.messages)
+		sched_yield();
+	result->seconds = (now_ns() - start) / 1e9;
+	// Every message has been read, so whatever was handed back can be freed
+	for(int i=0;i<config.producers;++i) {
+		free_messages(producer_states[i].returned);
+	}
+	if(config.blocking) {
+		for(int i=0;i<config.consumers;++i) {
+			struct bench_message *poison = message_queue_message_alloc_blocking(&queue);
+			poison->producer = -1;
+			message_queue_write(&queue, poison);
+		}
+	}
+	memset(&total, 0, sizeof(total));
+	for(int i=0;i<config.consumers;++i) {
+		pthread_join(consumers[i].thread, NULL);
+		for(int j=0;j<HISTOGRAM_BUCKETS;++j) {
+			total.buckets[j] += consumers[i].histogram.buckets[j];
+		}
+		total.count += consumers[i].histogram.count;
+	}
+	result->p50 = histogram_percentile(&total, 50);
+	result->p99 = histogram_percentile(&total, 99);
+	result->p999 = histogram_percentile(&total, 99.9);
+	pthread_barrier_destroy(&start_barrier);
+	message_queue_destroy(&queue);
+	free(producer_states);
+	free(consumers);
+	free(producers);
+	return 0;
+}
+
+static void parse_list(struct option_list *list, const char *arg, const char *names[]) {
+	char *copy = strdup(arg), *saveptr, *token;
+	list->count = 0;
+	for(token=strtok_r(copy, ",", &saveptr);token && list->count<MAX_VALUES;token=strtok_r(NULL, ",", &saveptr)) {
+		int value = atoi(token);
+		if(names) {
+			value = -1;
+			for(int i=0;names[i];++i) {
+				if(!strcmp(token, names[i]))
+					value = i;
+			}
+			if(value < 0) {
+				fprintf(stderr, "Unknown value: %s\n", token);
+				exit(1);
+			}
+		}
+		list->values[list->count++] = value;
+	}
+	free(copy);
+}
+
+int main(int argc, char *argv[]) {
+	static const char *read_names[] = {"poll", "block", NULL};
+	static const char *alloc_names[] = {"off", "on", NULL};
+	static const char *memory_names[] = {"default", "local", "thp", "local-thp", "hugetlb", "lazy", NULL};
+	static const char *format_names[] = {"csv", "json", NULL};
+	struct option_list producers, consumers, sizes, depths, reads, allocs, memories, shards, formats;
+	long messages = 1000000;
+	int json, first = 1, opt;
+	parse_list(&producers, "1,2,4", NULL);
+	parse_list(&consumers, "1,2,4", NULL);
+	parse_list(&sizes, "16,256", NULL);
+	parse_list(&depths, "128,4096", NULL);
+	parse_list(&reads, "block,poll", read_names);
+	parse_list(&allocs, "on,off", alloc_names);
+	parse_list(&memories, "default", memory_names);
+	parse_list(&shards, "0", NULL);
+	parse_list(&formats, "csv", format_names);
+	while((opt = getopt(argc, argv, "p:c:s:d:r:a:m:S:n:f:")) != -1) {
+		switch(opt) {
+		case 'p': parse_list(&producers, optarg, NULL); break;
+		case 'c': parse_list(&consumers, optarg, NULL); break;
+		case 's': parse_list(&sizes, optarg, NULL); break;
+		case 'd': parse_list(&depths, optarg, NULL); break;
+		case 'r': parse_list(&reads, optarg, read_names); break;
+		case 'a': parse_list(&allocs, optarg, alloc_names); break;
+		case 'm': parse_list(&memories, optarg, memory_names); break;
+		case 'S': parse_list(&shards, optarg, NULL); break;
+		case 'n': messages = atol(optarg); break;
+		case 'f': parse_list(&formats, optarg, format_names); break;
+		default:
+			fprintf(stderr, "Usage: %s [-p producers] [-c consumers] [-s size] [-d depth] [-r block|poll] [-a on|off] [-m default|local|thp|local-thp|hugetlb|lazy] [-S shards] [-n messages] [-f csv|json]\n", argv[0]);
+			return 1;
+		}
+	}
+	json = formats.values[0];
+	if(json)
+		printf("[\n");
+	else
+		printf("producers,consumers,message_size,max_depth,read,alloc,memory,shards,messages,seconds,msgs_per_sec,p50_ns,p99_ns,p999_ns\n");
+	for(int p=0;p<producers.count;++p)
+	for(int c=0;c<consumers.count;++c)
+	for(int s=0;s<sizes.count;++s)
+	for(int d=0;d<depths.count;++d)
+	for(int r=0;r<reads.count;++r)
+	for(int a=0;a<allocs.count;++a)
+	for(int m=0;m<memories.count;++m)
+	for(int k=0;k<shards.count;++k) {
+		struct bench_result result;
+		config.producers = producers.values[p];
+		config.consumers = consumers.values[c];
+		config.message_size = sizes.values[s] < sizeof(struct bench_message) ? sizeof(struct bench_message) : sizes.values[s];
+		config.max_depth = depths.values[d];
+		config.blocking = reads.values[r];
+		config.alloc = allocs.values[a];
+		config.memory = memories.values[m];
+		config.shards = shards.values[k];
+		config.messages = messages;
+		if(config.producers < 1 || config.consumers < 1 || config.max_depth < config.producers + config.consumers || run(&result)) {
+			fprintf(stderr, "Skipping invalid configuration\n");
+			continue;
+		}
+		if(json) {
+			printf("%s  {\"producers\": %d, \"consumers\": %d, \"message_size\": %d, \"max_depth\": %d, "
+			       "\"read\": \"%s\", \"alloc\": \"%s\", \"memory\": \"%s\", \"shards\": %d, \"messages\": %ld, \"seconds\": %.6f, "
+			       "\"msgs_per_sec\": %.0f, \"p50_ns\": %llu, \"p99_ns\": %llu, \"p999_ns\": %llu}",
+			       first ? "" : ",\n", config.producers, config.consumers, config.message_size, config.max_depth,
+			       read_names[config.blocking], alloc_names[config.alloc], memory_names[config.memory], config.shards, config.messages, result.seconds,
+			       config.messages / result.seconds, (unsigned long long)result.p50,
+			       (unsigned long long)result.p99, (unsigned long long)result.p999);
+		} else {
+			printf("%d,%d,%d,%d,%s,%s,%s,%d,%ld,%.6f,%.0f,%llu,%llu,%llu\n",
+			       config.producers, config.consumers, config.message_size, config.max_depth,
+			       read_names[config.blocking], alloc_names[config.alloc], memory_names[config.memory], config.shards, config.messages, result.seconds,
+			       config.messages / result.seconds, (unsigned long long)result.p50,
+			       (unsigned long long)result.p99, (unsigned long long)result.p999);
+		}
+		fflush(stdout);
+		first = 0;
+	}
+	if(json)
+		printf("\n]\n");
+	return 0;
+}
@@ -29,9 +29,20 @@
 
 /*
  * This sets up a thread pool to handle blocking file I/O operations. Socket
- * I/O is multiplexed with select in the main thread; socket writes are queued
- * through a message queue, sending a signal if necessary to wake the main
- * thread up if it's waiting in select.
+ * I/O is multiplexed with epoll in the main thread; socket writes are queued
+ * through a message queue, whose file descriptor is registered with the same
+ * epoll instance, so queued writes wake the main thread up just like socket
+ * events do. File contents go straight from the file to the
+ * socket with sendfile in the thread pool, so the queues only ever carry
+ * headers and control messages (which file, how far along it is), never the
+ * file data itself.
+ *
+ * The server runs until it's killed. Shutting the pool down with
+ * message_queue_pool_destroy would first finish every request already
+ * submitted, unlike the poison pills this example used to send, which
+ * jumped ahead of queued requests. Workers block on io_queue while they
+ * finish, so the main loop would have to keep servicing it until the
+ * pool was gone.
  *
  * So, this example demonstrates two uses of a message queue:
  *   * Distributing work to a thread pool
@@ -51,10 +62,15 @@
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <errno.h>
-#include <sys/select.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
 #include <pthread.h>
 #include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/sendfile.h>
 #include "../message_queue.h"
+#include "../message_queue_pool.h"
 
 // Forward-declare HTTP handling functions
 
@@ -62,7 +78,7 @@ static int open_http_listener();
 static void handle_client_data(int fd);
 static void handle_client_request(int fd, char *request);
 static void generate_client_reply(int fd, const char *filename);
-static int copy_data(int rfd, int fd);
+static void send_file(int rfd, int fd, off_t offset, size_t remaining);
 
 // Message queue related code
 
@@ -70,68 +86,40 @@ static int copy_data(int rfd, int fd);
 #define WORKER_THREADS 32
 #endif
 
+#ifndef MAX_CLIENTS
+#define MAX_CLIENTS 65536
+#endif
+
 struct www_op {
-	enum {OP_BEGIN, OP_READ_BLOCK, OP_EXIT} operation;
+	enum {OP_BEGIN, OP_SEND_FILE} operation;
 	const char *filename;
 	int rfd, fd;
+	off_t offset;
+	size_t remaining;
 };
 
+// buf holds the response headers; the body is sent from rfd starting at offset
 struct io_op {
-	char buf[1024];
+	char buf[256];
 	int len, pos;
 	int fd, rfd;
+	off_t offset;
+	size_t remaining;
 	int close_pending;
 };
 
-static struct message_queue worker_queue;
+static struct message_queue_pool worker_pool;
 static struct message_queue io_queue;
 
-static pthread_t main_thread;
-static pthread_t worker_threads[WORKER_THREADS];
-
-static int main_blocked;
-
-static void *worker_threadproc(void *dummy) {
-	while(1) {
-		struct www_op *message = message_queue_read(&worker_queue);
-		switch(message->operation) {
-		case OP_BEGIN:
-			generate_client_reply(message->fd, message->filename);
-			break;
-		case OP_READ_BLOCK:
-			copy_data(message->rfd, message->fd);
-			break;
-		case OP_EXIT:
-			message_queue_message_free(&worker_queue, message);
-			return NULL;
-		}
-		message_queue_message_free(&worker_queue, message);
-	}
-	return NULL;
-}
-
-static void threadpool_init() {
-	message_queue_init(&worker_queue, sizeof(struct www_op), 512);
-	for(int i=0;i<WORKER_THREADS;++i) {
-		pthread_create(&worker_threads[i], NULL, &worker_threadproc, NULL);
-	}
-}
-
-static void threadpool_destroy() {
-	for(int i=0;i<WORKER_THREADS;++i) {
-		struct www_op *poison = message_queue_message_alloc_blocking(&worker_queue);
-		poison->operation = OP_EXIT;
-		message_queue_write(&worker_queue, poison);
-	}
-	for(int i=0;i<WORKER_THREADS;++i) {
-		pthread_join(worker_threads[i], NULL);
-	}
-	message_queue_destroy(&worker_queue);
-}
-
-static void wake_main_thread() {
-	if(__sync_lock_test_and_set(&main_blocked, 0)) {
-		pthread_kill(main_thread, SIGUSR1);
+static void handle_www_op(void *data, void *context) {
+	struct www_op *message = data;
+	switch(message->operation) {
+	case OP_BEGIN:
+		generate_client_reply(message->fd, message->filename);
+		break;
+	case OP_SEND_FILE:
+		send_file(message->rfd, message->fd, message->offset, message->remaining);
+		break;
 	}
 }
 
@@ -168,7 +156,32 @@ struct client_state {
 	struct io_op *write_op;
 };
 
-struct client_state client_data[FD_SETSIZE];
+// Indexed by file descriptor, sized to the process's file descriptor limit
+// up to MAX_CLIENTS
+static struct client_state *client_data;
+static int max_clients;
+static int epoll_fd;
+
+static int watch_fd(int fd, int op, uint32_t events) {
+	struct epoll_event event;
+	event.events = events;
+	event.data.fd = fd;
+	return epoll_ctl(epoll_fd, op, fd, &event);
+}
+
+static int init_client_data() {
+	struct rlimit limit;
+	if(getrlimit(RLIMIT_NOFILE, &limit))
+		return -1;
+	// rlim_cur may be RLIM_INFINITY, which is larger than any real limit
+	max_clients = limit.rlim_cur > MAX_CLIENTS ? MAX_CLIENTS : limit.rlim_cur;
+	client_data = calloc(max_clients, sizeof(struct client_state));
+	if(!client_data) {
+		perror("Error allocating client table");
+		return -1;
+	}
+	return 0;
+}
 
 static int open_http_listener() {
 	int fd = socket(PF_INET, SOCK_STREAM, 0);
@@ -196,10 +209,12 @@ static void handle_client_data(int fd) {
 		if(client_data[fd].pos >= 4 && !strncmp(client_data[fd].buf+client_data[fd].pos-4, "\r\n\r\n", 4)) {
 			client_data[fd].buf[client_data[fd].pos] = '\0';
 			client_data[fd].state = CLIENT_INACTIVE;
+			// The worker pool owns the connection until it queues a write
+			watch_fd(fd, EPOLL_CTL_MOD, 0);
 			handle_client_request(fd, client_data[fd].buf);
 			return;
 		}
-	} else {
+	} else if(r == 0 || errno != EAGAIN) {
 		client_data[fd].state = CLIENT_INACTIVE;
 		close(fd);
 	}
@@ -212,11 +227,11 @@ static void handle_client_request(int fd, char *request) {
 		while(is_valid_filename_char(*filename_end))
 			++filename_end;
 		*filename_end = '\0';
-		struct www_op *message = message_queue_message_alloc_blocking(&worker_queue);
+		struct www_op *message = message_queue_pool_message_alloc_blocking(&worker_pool);
 		message->operation = OP_BEGIN;
 		message->filename = filename;
 		message->fd = fd;
-		message_queue_write(&worker_queue, message);
+		message_queue_pool_submit(&worker_pool, message);
 	} else {
 		close(fd);
 	}
@@ -228,43 +243,86 @@ static void generate_client_reply(int fd, const char *filename) {
 	if(rfd >= 0) {
 		struct stat st;
 		if(!fstat(rfd, &st)) {
-			snprintf(message->buf, 1024, "HTTP/1.0 200 OK\r\nContent-type: text/ascii\r\nContent-Length: %lu\r\n\r\n", (unsigned long)st.st_size);
-			message->buf[1023]  = '\0';
+			snprintf(message->buf, sizeof(message->buf), "HTTP/1.0 200 OK\r\nContent-type: text/ascii\r\nContent-Length: %lu\r\n\r\n", (unsigned long)st.st_size);
 			message->len = strlen(message->buf);
 			message->pos = 0;
 			message->fd = fd;
 			message->rfd = rfd;
+			message->offset = 0;
+			message->remaining = st.st_size;
 			message->close_pending = 0;
 			message_queue_write(&io_queue, message);
-			wake_main_thread();
 			return;
 		}
 	}
-	snprintf(message->buf, 1024, "HTTP/1.0 %s\r\n\r\n", errno_to_http_status());
+	snprintf(message->buf, sizeof(message->buf), "HTTP/1.0 %s\r\n\r\n", errno_to_http_status());
 	message->len = strlen(message->buf);
 	message->pos = 0;
 	message->fd = fd;
 	message->rfd = rfd;
+	message->remaining = 0;
 	message->close_pending = 1;
-	message->buf[1024] = '\0';
 	message_queue_write(&io_queue, message);
-	wake_main_thread();
 }
 
-static int copy_data(int rfd, int fd) {
+static void send_file(int rfd, int fd, off_t offset, size_t remaining) {
 	struct io_op *message = message_queue_message_alloc_blocking(&io_queue);
-	message->len = read(rfd, message->buf, 1024);
+	ssize_t r = 0;
+	// The socket is non-blocking, so this stops as soon as it's full
+	while(remaining && (r = sendfile(fd, rfd, &offset, remaining)) > 0)
+		remaining -= r;
+	message->len = 0;
 	message->pos = 0;
 	message->fd = fd;
 	message->rfd = rfd;
-	if(message->len) {
-		message->close_pending = 0;
+	message->offset = offset;
+	message->remaining = remaining;
+	// Give up on errors or if the file shrank; otherwise wait for the socket to drain
+	message->close_pending = !remaining || r == 0 || (r < 0 && errno != EAGAIN);
+	message_queue_write(&io_queue, message);
+}
+
+static void handle_client_write(int fd) {
+	struct io_op *op = client_data[fd].write_op;
+	if(op->pos < op->len) {
+		int r = write(fd, op->buf+op->pos, op->len-op->pos);
+		if(r < 0 && errno == EAGAIN)
+			return;
+		if(r < 0) {
+			op->close_pending = 1;
+		} else {
+			op->pos += r;
+			if(op->pos < op->len)
+				return;
+		}
+	}
+	client_data[fd].state = CLIENT_INACTIVE;
+	watch_fd(fd, EPOLL_CTL_MOD, 0);
+	if(op->close_pending) {
+		if(op->rfd >= 0)
+			close(op->rfd);
+		close(fd);
 	} else {
-		message->len = 0;
-		message->close_pending = 1;
+		struct www_op *message = message_queue_pool_message_alloc_blocking(&worker_pool);
+		message->operation = OP_SEND_FILE;
+		message->fd = fd;
+		message->rfd = op->rfd;
+		message->offset = op->offset;
+		message->remaining = op->remaining;
+		message_queue_pool_submit(&worker_pool, message);
 	}
-	message_queue_write(&io_queue, message);
-	wake_main_thread();
+	message_queue_message_free(&io_queue, op);
+}
+
+static void close_client(int fd) {
+	if(client_data[fd].state == CLIENT_WRITING) {
+		struct io_op *op = client_data[fd].write_op;
+		if(op->rfd >= 0)
+			close(op->rfd);
+		message_queue_message_free(&io_queue, op);
+	}
+	client_data[fd].state = CLIENT_INACTIVE;
+	close(fd);
 }
 
 static void service_io_message_queue() {
@@ -272,90 +330,63 @@ static void service_io_message_queue() {
 	while(message = message_queue_tryread(&io_queue)) {
 		client_data[message->fd].state = CLIENT_WRITING;
 		client_data[message->fd].write_op = message;
+		// This fails if the client hung up while the worker pool had it
+		if(watch_fd(message->fd, EPOLL_CTL_MOD, EPOLLOUT))
+			close_client(message->fd);
 	}
 }
 
-static void handle_signal(int signal) {
-}
-
 int main(int argc, char *argv[]) {
-	main_thread = pthread_self();
-	signal(SIGUSR1, &handle_signal);
 	signal(SIGPIPE, SIG_IGN);
 	message_queue_init(&io_queue, sizeof(struct io_op), 128);
-	threadpool_init();
+	message_queue_pool_init(&worker_pool, WORKER_THREADS, sizeof(struct www_op), 512, &handle_www_op, NULL);
+	int io_fd = message_queue_get_fd(&io_queue);
 	int fd = open_http_listener();
-	if(fd >= 0) {
+	epoll_fd = epoll_create1(0);
+	if(fd >= 0 && io_fd >= 0 && epoll_fd >= 0 && !init_client_data()) {
+		struct epoll_event events[256];
+		watch_fd(fd, EPOLL_CTL_ADD, EPOLLIN);
+		watch_fd(io_fd, EPOLL_CTL_ADD, EPOLLIN);
 		while(1) {
-			fd_set rfds, wfds;
-			int max_fd, r;
-			main_blocked = 1;
-			__sync_synchronize();
-			service_io_message_queue();
-			FD_ZERO(&rfds);
-			FD_ZERO(&wfds);
-			max_fd = 0;
-			FD_SET(fd, &rfds);
-			for(int i=0;i<FD_SETSIZE;++i) {
-				if(client_data[i].state == CLIENT_READING) {
-					FD_SET(i, &rfds);
-					max_fd = i;
-				} else if(client_data[i].state == CLIENT_WRITING) {
-					FD_SET(i, &wfds);
-					max_fd = i;
-				}
-			}
-			max_fd = fd > max_fd ? fd : max_fd;
-			r = select(max_fd+1, &rfds, &wfds, NULL, NULL);
-			main_blocked = 0;
-			__sync_synchronize();
+			int r = epoll_wait(epoll_fd, events, sizeof(events)/sizeof(events[0]), -1);
 			if(r < 0 && errno != EINTR) {
-				perror("Error in select");
+				perror("Error in epoll_wait");
 				return -1;
 			}
-			if(r > 0) {
-				if(FD_ISSET(fd, &rfds)) {
+			for(int i=0;i<r;++i) {
+				int efd = events[i].data.fd;
+				if(efd == io_fd) {
+					// Reset the descriptor and pick up the queued writes
+					uint64_t count;
+					read(io_fd, &count, sizeof(count));
+					service_io_message_queue();
+				} else if(efd == fd) {
 					struct sockaddr_in peer_addr;
 					socklen_t peer_len = sizeof(peer_addr);
 					int cfd = accept(fd, (struct sockaddr *)&peer_addr, &peer_len);
-					if(cfd >= 0) {
+					if(cfd >= max_clients) {
+						close(cfd);
+					} else if(cfd >= 0) {
 						int flags = fcntl(cfd, F_GETFL, 0);
-						fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+						fcntl(cfd, F_SETFL, flags | O_NONBLOCK);
 						client_data[cfd].state = CLIENT_READING;
 						client_data[cfd].pos = 0;
+						if(watch_fd(cfd, EPOLL_CTL_ADD, EPOLLIN))
+							close(cfd);
 					}
-				}
-				for(int i=0;i<FD_SETSIZE;++i) {
-					if(i != fd && FD_ISSET(i, &rfds)) {
-						handle_client_data(i);
-					} else if(i != fd && FD_ISSET(i, &wfds)) {
-						int r = write(i, client_data[i].write_op->buf+client_data[i].write_op->pos, client_data[i].write_op->len-client_data[i].write_op->pos);
-						if(r >= 0) {
-							client_data[i].write_op->pos += r;
-							if(client_data[i].write_op->pos == client_data[i].write_op->len) {
-								client_data[i].state = CLIENT_INACTIVE;
-								if(client_data[i].write_op->close_pending) {
-									close(client_data[i].write_op->rfd);
-									close(i);
-								} else {
-									struct www_op *message = message_queue_message_alloc_blocking(&worker_queue);
-									message->operation = OP_READ_BLOCK;
-									message->fd = i;
-									message->rfd = client_data[i].write_op->rfd;
-									message_queue_write(&worker_queue, message);
-								}
-								message_queue_message_free(&io_queue, client_data[i].write_op);
-							}
-						} else {
-							close(client_data[i].write_op->rfd);
-							close(i);
-							message_queue_message_free(&io_queue, client_data[i].write_op);
-							client_data[i].state = CLIENT_INACTIVE;
-						}
-					}
+				} else if(events[i].events & (EPOLLERR | EPOLLHUP)) {
+					// A parked client belongs to the worker pool, so just stop
+					// watching it; its next write finds it gone and closes it
+					if(client_data[efd].state == CLIENT_INACTIVE)
+						watch_fd(efd, EPOLL_CTL_DEL, 0);
+					else
+						close_client(efd);
+				} else if(client_data[efd].state == CLIENT_READING) {
+					handle_client_data(efd);
+				} else if(client_data[efd].state == CLIENT_WRITING) {
+					handle_client_write(efd);
 				}
 			}
-			service_io_message_queue();
 		}
 	} else {
 		perror("Error listening on *:8080");
@@ -28,195 +28,2090 @@
  */
 
 #include "message_queue.h"
-#include <inttypes.h>
-#include <stdlib.h>
-#include <unistd.h>
-#include <stdio.h>
-#include <fcntl.h>
+#include "message_queue_internal.h"
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+
+#ifndef SLOT_SPIN_COUNT
+#define SLOT_SPIN_COUNT 128
+#endif
+
+// Adaptive waits always spin at least this long, so they can notice when messages start arriving faster
+#ifndef WAIT_MIN_SPINS
+#define WAIT_MIN_SPINS 16
+#endif
+
+#ifndef STATS_SHARDS
+#define STATS_SHARDS 32
+#endif
+
+#ifndef MAGAZINES_PER_THREAD
+#define MAGAZINES_PER_THREAD 8
+#endif
+
+#ifndef HUGE_PAGE_SIZE
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+#endif
+
+#ifndef MPOL_BIND
+#define MPOL_BIND 2
+#endif
+
+#define MESSAGE_QUEUE_MAGIC 0x4d515545
+
+// Set in flags when memory, the freelists and the ring are one private mapping
+#define MESSAGE_QUEUE_MAPPED 2
+
+static inline int max(int x, int y) {
+	return x > y ? x : y;
+}
+
+static inline char *queue_memory(struct message_queue *queue) {
+	return (char *)queue + queue->memory;
+}
+
+static inline struct message_queue_slot *allocator_freelist(struct message_queue *queue, struct message_queue_allocator *allocator) {
+	return (struct message_queue_slot *)((char *)queue + allocator->freelist);
+}
+
+static inline struct message_queue_allocator *queue_classes(struct message_queue *queue) {
+	return (struct message_queue_allocator *)((char *)queue + queue->classes);
+}
+
+static inline struct message_queue_slot *queue_ring(struct message_queue *queue) {
+	return (struct message_queue_slot *)((char *)queue + queue->queue_data);
+}
+
+static inline int queue_shared(struct message_queue *queue) {
+	return queue->flags & MESSAGE_QUEUE_SHARED;
+}
+
+/*
+ * Statistics. Each thread adds to one of STATS_SHARDS cache-line-sized sets
+ * of counters, picked when the thread first counts something, so threads
+ * rarely share a line. Snapshots add the shards up. All of this is skipped
+ * unless the queue has statistics enabled.
+ */
+struct message_queue_stats_shard {
+	uint64_t enqueues;
+	uint64_t dequeues;
+	uint64_t failed_allocs;
+	uint64_t spins;
+	uint64_t parks;
+	uint64_t wakes;
+	int high_water;
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+static unsigned int next_stats_shard;
+static __thread int thread_stats_shard = -1;
+
+static inline int thread_shard() {
+	if(thread_stats_shard < 0)
+		thread_stats_shard = __sync_fetch_and_add(&next_stats_shard, 1) % STATS_SHARDS;
+	return thread_stats_shard;
+}
 
-union padding {
-	char chardata;
-	short shortdata;
-	int intdata;
-	long longdata;
-	float floatdata;
-	double doubledata;
-	void *pointerdata;
+static inline struct message_queue_stats_shard *stats_shard(struct message_queue *queue) {
+	struct message_queue_stats_shard *stats = queue->stats;
+	if(!stats)
+		return NULL;
+	return &stats[thread_shard()];
+}
+
+#define COUNT_STAT(queue, counter, n) \
+	do { \
+		struct message_queue_stats_shard *shard_ = stats_shard(queue); \
+		if(shard_) \
+			__atomic_fetch_add(&shard_->counter, (n), __ATOMIC_RELAXED); \
+	} while(0)
+
+static inline void count_enqueues(struct message_queue *queue, int depth, int count) {
+	struct message_queue_stats_shard *shard = stats_shard(queue);
+	if(shard) {
+		int high_water = __atomic_load_n(&shard->high_water, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&shard->enqueues, count, __ATOMIC_RELAXED);
+		while(depth > high_water && !__atomic_compare_exchange_n(&shard->high_water, &high_water, depth, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+	}
+}
+
+/*
+ * Tracing. stamps has a time for each slot of the main ring, written after
+ * the writer has the slot and before it publishes, so the reader that waits
+ * for the slot sees it. Waits go into log-linear histograms, sharded by
+ * thread like the statistics: TRACE_SUB_BITS buckets for every power of two.
+ */
+#define TRACE_SUB_BITS 3
+#define TRACE_BUCKETS (64 << TRACE_SUB_BITS)
+
+struct message_queue_trace_shard {
+	uint64_t buckets[TRACE_BUCKETS];
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+struct message_queue_tracing {
+	uint64_t *stamps;
+	struct message_queue_trace_shard shards[STATS_SHARDS];
 };
 
-static inline int pad_size(int size) {
-	return size % sizeof(union padding) ?
-	       (size + (sizeof(union padding) - (size % sizeof(union padding)))) :
-		   size;
+static inline uint64_t trace_now(struct message_queue *queue) {
+	struct timespec ts;
+	if(!__atomic_load_n(&queue->tracing, __ATOMIC_ACQUIRE))
+		return 0;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
 }
 
-static inline uint32_t round_to_pow2(uint32_t x) {
-	x--;
-	x |= x >> 1;
-	x |= x >> 2;
-	x |= x >> 4;
-	x |= x >> 8;
-	x |= x >> 16;
-	x++;
-	return x;
+static inline int trace_bucket(uint64_t value) {
+	if(value < (1 << TRACE_SUB_BITS))
+		return value;
+	int exponent = 63 - __builtin_clzll(value) - TRACE_SUB_BITS;
+	return ((exponent + 1) << TRACE_SUB_BITS) + ((value >> exponent) & ((1 << TRACE_SUB_BITS) - 1));
 }
 
-static inline int max(int x, int y) {
-	return x > y ? x : y;
+// The largest value that lands in a bucket
+static inline uint64_t trace_bucket_max(int bucket) {
+	if(bucket < (1 << TRACE_SUB_BITS))
+		return bucket;
+	int exponent = (bucket >> TRACE_SUB_BITS) - 1;
+	return (((uint64_t)((1 << TRACE_SUB_BITS) + (bucket & ((1 << TRACE_SUB_BITS) - 1))) + 1) << exponent) - 1;
 }
 
-int message_queue_init(struct message_queue *queue, int message_size, int max_depth) {
-	char sem_name[128];
-	queue->message_size = pad_size(message_size);
-	queue->max_depth = round_to_pow2(max_depth);
-	queue->memory = malloc(queue->message_size * max_depth);
-	if(!queue->memory)
-		goto error;
-	queue->freelist = malloc(sizeof(void *) * queue->max_depth);
-	if(!queue->freelist)
-		goto error_after_memory;
-	for(int i=0;i<queue->max_depth;++i) {
-		queue->freelist[i] = queue->memory + (sizeof(void *) * i);
-	}
-	snprintf(sem_name, 128, "%d_%p", getpid(), &queue->allocator);
-	sem_name[127] = '\0';
-	do {
-		queue->allocator.sem = sem_open(sem_name, O_CREAT | O_EXCL, 0600, 0);
-	} while(queue->allocator.sem == SEM_FAILED && errno == EINTR);
-	if(queue->allocator.sem == SEM_FAILED)
-		goto error_after_freelist;
-	sem_unlink(sem_name);
-	queue->allocator.blocked_readers = 0;
-	queue->allocator.free_blocks = queue->max_depth;
-	queue->allocator.allocpos = 0;
-	queue->allocator.freepos = 0;
-	queue->queue_data = malloc(sizeof(void *) * queue->max_depth);
-	if(!queue->queue_data)
-		goto error_after_alloc_sem;
-	for(int i=0;i<queue->max_depth;++i) {
-		queue->queue_data[i] = NULL;
+/*
+ * Priority lanes. Each level gets its own ring, sized like the main one since
+ * any level may end up holding every message. queue.entries still counts
+ * everything, so a reader reserves a message there first and then takes it
+ * from the highest lane whose bit is set in nonempty. A writer sets its
+ * lane's bit after adding to the lane and before adding to queue.entries, so
+ * a reader holding a reservation always finds a bit to follow.
+ */
+struct message_queue_lane {
+	struct message_queue_slot *ring;
+	int entries;
+	unsigned int slot_waiters;
+	unsigned int readpos __attribute__((aligned(CACHE_LINE_SIZE)));
+	unsigned int writepos __attribute__((aligned(CACHE_LINE_SIZE)));
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+struct message_queue_priorities {
+	unsigned int nonempty;
+	int levels;
+	struct message_queue_lane lanes[];
+};
+
+/*
+ * Shards are lanes picked by thread instead of by priority. A thread's home
+ * shard is fixed the first time it touches any sharded queue, which keeps
+ * its messages in order. There's no queue-wide count, so queue.entries
+ * stays at zero and queue_depth adds up the shards instead.
+ */
+struct message_queue_shards {
+	int count;
+	struct message_queue_lane shards[];
+};
+
+static unsigned int next_home_shard;
+static __thread int thread_home_shard = -1;
+
+static inline int home_shard(struct message_queue *queue) {
+	if(thread_home_shard < 0)
+		thread_home_shard = __sync_fetch_and_add(&next_home_shard, 1) & INT_MAX;
+	return thread_home_shard % queue->shards->count;
+}
+
+/*
+ * Growth. Extra messages come in segments the size of the largest class,
+ * each with its own freelist, described in a fixed array so that lock-free
+ * scans never see a descriptor go away. Segments are added and retired under
+ * a mutex, off the fast path; active has a bit for each segment in use.
+ *
+ * The ring must hold every message, so growing past its depth starts a new,
+ * deeper ring. The old one is sealed by setting RING_SEALED in its writepos:
+ * writers that see the bit move on to next, and readers move on once they've
+ * passed sealed_at, where writing stopped. Old rings are kept until the queue
+ * is destroyed, since a thread might still be looking at one; that's bounded
+ * because a new ring is only needed when the queue gets bigger than ever.
+ */
+#define RING_SEALED (1ULL << 63)
+
+struct ring_segment {
+	struct ring_segment *next;
+	struct message_queue_slot *slots;
+	unsigned int max_depth;
+	unsigned int slot_waiters;
+	uint64_t sealed_at;
+	uint64_t readpos __attribute__((aligned(CACHE_LINE_SIZE)));
+	uint64_t writepos __attribute__((aligned(CACHE_LINE_SIZE)));
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+struct message_queue_growth {
+	pthread_mutex_t lock;
+	size_t max_memory;
+	size_t memory;
+	unsigned int blocks;
+	unsigned long long active;
+	struct ring_segment *head __attribute__((aligned(CACHE_LINE_SIZE)));
+	struct ring_segment *tail __attribute__((aligned(CACHE_LINE_SIZE)));
+	struct ring_segment ring;
+	struct message_queue_allocator segments[MESSAGE_QUEUE_MAX_SEGMENTS];
+};
+
+/*
+ * Threads in message_queue_select park on a word of their own, with a waiter
+ * pointing at it linked into the list of every queue they're watching.
+ * Writers only take the lock to wake them when waiting says somebody's there.
+ */
+struct select_waiter {
+	unsigned int *wakeup;
+	struct select_waiter *next;
+	struct select_waiter *prev;
+};
+
+struct message_queue_selectors {
+	pthread_mutex_t lock;
+	unsigned int waiting;
+	struct select_waiter *waiters;
+};
+
+/*
+ * Slot handoff. A slot is only ever waited on briefly: the counters guarantee
+ * that the thread on the other side of the handoff has already claimed the
+ * position and just hasn't finished with it yet. So spin for a little while,
+ * then park on the slot's sequence word. Publishers only pay for the wakeup
+ * syscall if somebody actually parked.
+ */
+static void slot_wait(struct message_queue *queue, struct message_queue_slot *slot, unsigned int seq, unsigned int *waiters) {
+	unsigned int cur;
+	unsigned int spins = 0;
+	int yields = 0;
+	while(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != seq) {
+		if(spins < SLOT_SPIN_COUNT || queue->wait.mode == MESSAGE_QUEUE_WAIT_SPIN) {
+			++spins;
+			cpu_relax();
+		} else if(yields < queue->wait.yields) {
+			++yields;
+			sched_yield();
+		} else {
+			goto park;
+		}
+	}
+	if(spins)
+		COUNT_STAT(queue, spins, spins);
+	return;
+park:
+	COUNT_STAT(queue, spins, spins);
+	__sync_fetch_and_add(waiters, 1);
+	while((cur = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE)) != seq) {
+		COUNT_STAT(queue, parks, 1);
+		futex_wait(&slot->seq, cur, queue_shared(queue));
+	}
+	__sync_fetch_and_add(waiters, -1);
+}
+
+static inline void slot_publish(struct message_queue *queue, struct message_queue_slot *slot, unsigned int seq, unsigned int *waiters) {
+	__atomic_store_n(&slot->seq, seq, __ATOMIC_SEQ_CST);
+	if(__atomic_load_n(waiters, __ATOMIC_SEQ_CST)) {
+		COUNT_STAT(queue, wakes, 1);
+		futex_wake(&slot->seq, INT_MAX, queue_shared(queue));
+	}
+}
+
+/*
+ * Rings hold each message's offset from the start of the queue's memory, so
+ * they mean the same thing in every process that maps the queue.
+ */
+static inline void ring_put(struct message_queue *queue, struct message_queue_slot *ring, unsigned int max_depth, unsigned int pos, void *message, unsigned int *waiters) {
+	unsigned int lap = pos & ~(max_depth - 1);
+	struct message_queue_slot *slot = &ring[pos & (max_depth - 1)];
+	slot_wait(queue, slot, lap, waiters);
+	slot->data = (char *)message - queue_memory(queue);
+	slot_publish(queue, slot, lap + 1, waiters);
+}
+
+static inline void *ring_take(struct message_queue *queue, struct message_queue_slot *ring, unsigned int max_depth, unsigned int pos, unsigned int *waiters) {
+	unsigned int lap = pos & ~(max_depth - 1);
+	struct message_queue_slot *slot = &ring[pos & (max_depth - 1)];
+	slot_wait(queue, slot, lap + 1, waiters);
+	void *rv = queue_memory(queue) + slot->data;
+	slot_publish(queue, slot, lap + max_depth, waiters);
+	return rv;
+}
+
+/*
+ * ring_put and ring_take for the main ring, stamping messages on the way in
+ * and timing them on the way out if the queue is traced. now comes from
+ * trace_now, and is 0 if tracing was off when the writer looked. A stamp of
+ * 0 means the message wasn't stamped, which is the case for messages written
+ * before tracing was enabled or while it was being enabled, so readers clear
+ * each stamp after reading it.
+ */
+static inline void queue_put(struct message_queue *queue, unsigned int pos, void *message, uint64_t now) {
+	struct message_queue_tracing *tracing = __atomic_load_n(&queue->tracing, __ATOMIC_ACQUIRE);
+	struct message_queue_slot *slot;
+	unsigned int lap;
+	if(!tracing) {
+		ring_put(queue, queue_ring(queue), queue->max_depth, pos, message, &queue->queue.slot_waiters);
+		return;
+	}
+	lap = pos & ~(queue->max_depth - 1);
+	slot = &queue_ring(queue)[pos & (queue->max_depth - 1)];
+	slot_wait(queue, slot, lap, &queue->queue.slot_waiters);
+	slot->data = (char *)message - queue_memory(queue);
+	tracing->stamps[pos & (queue->max_depth - 1)] = now;
+	slot_publish(queue, slot, lap + 1, &queue->queue.slot_waiters);
+}
+
+static inline void *queue_take(struct message_queue *queue, unsigned int pos, uint64_t now) {
+	struct message_queue_slot *slot;
+	struct message_queue_tracing *tracing = __atomic_load_n(&queue->tracing, __ATOMIC_ACQUIRE);
+	unsigned int lap;
+	uint64_t stamp;
+	void *rv;
+	if(!tracing)
+		return ring_take(queue, queue_ring(queue), queue->max_depth, pos, &queue->queue.slot_waiters);
+	lap = pos & ~(queue->max_depth - 1);
+	slot = &queue_ring(queue)[pos & (queue->max_depth - 1)];
+	slot_wait(queue, slot, lap + 1, &queue->queue.slot_waiters);
+	rv = queue_memory(queue) + slot->data;
+	stamp = tracing->stamps[pos & (queue->max_depth - 1)];
+	tracing->stamps[pos & (queue->max_depth - 1)] = 0;
+	slot_publish(queue, slot, lap + queue->max_depth, &queue->queue.slot_waiters);
+	// now is read before waiting for the slot, so a slow writer's stamp can be later
+	if(stamp && now)
+		__atomic_fetch_add(&tracing->shards[thread_shard()].buckets[trace_bucket(now > stamp ? now - stamp : 0)], 1, __ATOMIC_RELAXED);
+	return rv;
+}
+
+/*
+ * Take up to max from a counter of available entries with a single atomic,
+ * returning how many were taken.
+ */
+static inline int claim(int *counter, int max) {
+	int cur = __atomic_load_n(counter, __ATOMIC_RELAXED);
+	while(cur > 0) {
+		int n = cur < max ? cur : max;
+		int prev = __sync_val_compare_and_swap(counter, cur, cur - n);
+		if(prev == cur)
+			return n;
+		cur = prev;
+	}
+	return 0;
+}
+
+static void lane_put(struct message_queue *queue, int level, void **messages, int count) {
+	struct message_queue_priorities *priorities = queue->priorities;
+	struct message_queue_lane *lane = &priorities->lanes[level];
+	unsigned int pos = __sync_fetch_and_add(&lane->writepos, count);
+	for(int i=0;i<count;++i) {
+		ring_put(queue, lane->ring, queue->max_depth, pos + i, messages[i], &lane->slot_waiters);
+	}
+	__sync_fetch_and_add(&lane->entries, count);
+	if(!(__atomic_load_n(&priorities->nonempty, __ATOMIC_SEQ_CST) & (1u << level)))
+		__atomic_fetch_or(&priorities->nonempty, 1u << level, __ATOMIC_SEQ_CST);
+}
+
+static void *lane_take(struct message_queue *queue) {
+	struct message_queue_priorities *priorities = queue->priorities;
+	for(;;) {
+		unsigned int nonempty = __atomic_load_n(&priorities->nonempty, __ATOMIC_SEQ_CST);
+		if(!nonempty) {
+			// Another reader is between clearing a bit and setting it again
+			cpu_relax();
+			continue;
+		}
+		int level = 31 - __builtin_clz(nonempty);
+		struct message_queue_lane *lane = &priorities->lanes[level];
+		int entries = __atomic_load_n(&lane->entries, __ATOMIC_RELAXED);
+		while(entries > 0 && !__atomic_compare_exchange_n(&lane->entries, &entries, entries - 1, 1, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+		if(entries <= 1) {
+			// Clear the bit of a drained lane unless a writer refilled it
+			__atomic_fetch_and(&priorities->nonempty, ~(1u << level), __ATOMIC_SEQ_CST);
+			if(__atomic_load_n(&lane->entries, __ATOMIC_SEQ_CST) > 0)
+				__atomic_fetch_or(&priorities->nonempty, 1u << level, __ATOMIC_SEQ_CST);
+		}
+		if(entries > 0) {
+			unsigned int pos = __sync_fetch_and_add(&lane->readpos, 1);
+			return ring_take(queue, lane->ring, queue->max_depth, pos, &lane->slot_waiters);
+		}
+	}
+}
+
+/*
+ * Blocking waits for the allocator and the queue. wakeup is bumped every time
+ * a writer finds a registered reader, so a reader that registers and then
+ * finds the ring still empty can't miss the wakeup meant for it.
+ */
+static inline void wake_blocked_readers(struct message_queue *queue, unsigned int *wakeup, unsigned int *blocked_readers, int count) {
+	if(__atomic_load_n(blocked_readers, __ATOMIC_SEQ_CST)) {
+		COUNT_STAT(queue, wakes, 1);
+		__sync_fetch_and_add(wakeup, 1);
+		futex_wake(wakeup, count, queue_shared(queue));
+	}
+}
+
+static void wake_selectors(struct message_queue *queue) {
+	struct message_queue_selectors *selectors = __atomic_load_n(&queue->selectors, __ATOMIC_SEQ_CST);
+	if(selectors && __atomic_load_n(&selectors->waiting, __ATOMIC_SEQ_CST)) {
+		pthread_mutex_lock(&selectors->lock);
+		for(struct select_waiter *waiter=selectors->waiters;waiter;waiter=waiter->next) {
+			__sync_fetch_and_add(waiter->wakeup, 1);
+			futex_wake(waiter->wakeup, 1, 0);
+		}
+		pthread_mutex_unlock(&selectors->lock);
+	}
+}
+
+/*
+ * Writers signal the queue's eventfd, if anybody has asked for one, when the
+ * number of entries goes up from zero (or below: failed reads dip it
+ * negative for a moment).
+ */
+static inline void signal_eventfd(struct message_queue *queue, int entries) {
+	int fd = __atomic_load_n(&queue->queue.eventfd, __ATOMIC_RELAXED);
+	if(entries <= 0 && fd >= 0) {
+		uint64_t one = 1;
+		while(write(fd, &one, sizeof(one)) < 0 && errno == EINTR);
 	}
+}
+
+/*
+ * Fills in an allocator's freelist and counters once its size, depth and
+ * offsets are set. A lazy allocator's freelist must already be zeroed, which
+ * is an empty ring; its messages start out as fresh blocks instead.
+ */
+static void init_allocator(struct message_queue *queue, struct message_queue_allocator *allocator, int lazy) {
+	struct message_queue_slot *freelist = allocator_freelist(queue, allocator);
+	if(!lazy) {
+		for(int i=0;i<allocator->max_depth;++i) {
+			freelist[i].seq = 1;
+			freelist[i].data = allocator->memory + (intptr_t)allocator->message_size * i;
+		}
+	}
+	allocator->wakeup = 0;
+	allocator->blocked_readers = 0;
+	allocator->slot_waiters = 0;
+	allocator->free_blocks = allocator->max_depth;
+	allocator->fresh_blocks = lazy ? allocator->max_depth : 0;
+	allocator->allocpos = 0;
+	allocator->freepos = lazy ? 0 : allocator->max_depth;
+}
+
+/*
+ * Fills in the ring and counters once max_depth and queue_data are set. A
+ * lazy ring must already be zeroed.
+ */
+static void init_ring(struct message_queue *queue, int lazy) {
+	struct message_queue_slot *queue_data = queue_ring(queue);
+	if(!lazy) {
+		for(int i=0;i<queue->max_depth;++i) {
+			queue_data[i].seq = 0;
+			queue_data[i].data = 0;
+		}
+	}
+	queue->queue.wakeup = 0;
 	queue->queue.blocked_readers = 0;
-	snprintf(sem_name, 128, "%d_%p", getpid(), queue);
-	sem_name[127] = '\0';
-	do {
-		queue->queue.sem = sem_open(sem_name, O_CREAT | O_EXCL, 0600, 0);
-	} while(queue->queue.sem == SEM_FAILED && errno == EINTR);
-	if(queue->queue.sem == SEM_FAILED)
-		goto error_after_queue;
-	sem_unlink(sem_name);
+	queue->queue.slot_waiters = 0;
 	queue->queue.entries = 0;
+	queue->queue.eventfd = -1;
 	queue->queue.readpos = 0;
 	queue->queue.writepos = 0;
+}
+
+static inline size_t align_up(size_t size) {
+	return (size + CACHE_LINE_SIZE - 1) & ~(size_t)(CACHE_LINE_SIZE - 1);
+}
+
+static int bind_numa_node(void *memory, size_t size, const struct message_queue_options *options) {
+#ifdef __linux__
+	unsigned long nodemask[16] = {0};
+	unsigned int cpu, node = options->numa_node;
+	if(options->flags & MESSAGE_QUEUE_NUMA_LOCAL) {
+		if(syscall(SYS_getcpu, &cpu, &node, NULL))
+			return -1;
+	}
+	if(node >= sizeof(nodemask) * CHAR_BIT) {
+		errno = EINVAL;
+		return -1;
+	}
+	nodemask[node / (sizeof(unsigned long) * CHAR_BIT)] |= 1UL << (node % (sizeof(unsigned long) * CHAR_BIT));
+	return syscall(SYS_mbind, memory, size, MPOL_BIND, nodemask, sizeof(nodemask) * CHAR_BIT, 0);
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+/*
+ * Maps memory for message_queue_init_options. size is rounded up to what was
+ * actually mapped. The NUMA policy is set before anything touches the pages,
+ * so they're allocated on the right node in the first place.
+ */
+static void *map_queue_memory(size_t *size, const struct message_queue_options *options) {
+	int huge = options->flags & (MESSAGE_QUEUE_HUGEPAGES | MESSAGE_QUEUE_HUGETLB);
+	size_t page_size = huge ? HUGE_PAGE_SIZE : (size_t)sysconf(_SC_PAGESIZE);
+	char *memory;
+	*size = (*size + page_size - 1) & ~(page_size - 1);
+	if(options->flags & MESSAGE_QUEUE_HUGETLB) {
+#ifdef MAP_HUGETLB
+		memory = mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if(memory == MAP_FAILED)
+			return NULL;
+#else
+		errno = ENOSYS;
+		return NULL;
+#endif
+	} else if(huge) {
+		// Map an extra huge page so the mapping can be trimmed to an aligned one
+		char *mapping = mmap(NULL, *size + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if(mapping == MAP_FAILED)
+			return NULL;
+		memory = (char *)(((uintptr_t)mapping + HUGE_PAGE_SIZE - 1) & ~(uintptr_t)(HUGE_PAGE_SIZE - 1));
+		if(memory > mapping)
+			munmap(mapping, memory - mapping);
+		munmap(memory + *size, mapping + HUGE_PAGE_SIZE - memory);
+#ifdef MADV_HUGEPAGE
+		madvise(memory, *size, MADV_HUGEPAGE);
+#endif
+	} else {
+		memory = mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if(memory == MAP_FAILED)
+			return NULL;
+	}
+	if(options->flags & (MESSAGE_QUEUE_NUMA_NODE | MESSAGE_QUEUE_NUMA_LOCAL)) {
+		if(bind_numa_node(memory, *size, options)) {
+			int err = errno;
+			munmap(memory, *size);
+			errno = err;
+			return NULL;
+		}
+	}
+	return memory;
+}
+
+int message_queue_init(struct message_queue *queue, int message_size, int max_depth) {
+	struct message_queue_size_class size_class = {message_size, max_depth};
+	return message_queue_init_classes(queue, &size_class, 1);
+}
+
+int message_queue_init_classes(struct message_queue *queue, const struct message_queue_size_class *classes, int num_classes) {
+	return message_queue_init_options(queue, classes, num_classes, NULL);
+}
+
+int message_queue_init_options(struct message_queue *queue, const struct message_queue_size_class *classes, int num_classes, const struct message_queue_options *options) {
+	struct message_queue_allocator *allocators = NULL;
+	void *memory, *freelists, *queue_data;
+	size_t memory_size = 0;
+	unsigned int total_depth = 0;
+	int lazy = options && (options->flags & MESSAGE_QUEUE_LAZY);
+	if(num_classes < 1)
+		goto error;
+	for(int i=1;i<num_classes;++i) {
+		if(classes[i].message_size <= classes[i-1].message_size)
+			goto error;
+	}
+	for(int i=0;i<num_classes;++i) {
+		memory_size += (size_t)pad_size(classes[i].message_size) * round_to_pow2(classes[i].count);
+		total_depth += round_to_pow2(classes[i].count);
+	}
+	queue->message_size = pad_size(classes[num_classes-1].message_size);
+	queue->max_depth = round_to_pow2(total_depth);
+	queue->flags = 0;
+	queue->magic = 0;
+	queue->magazine_size = 0;
+	queue->mapping_size = 0;
+	queue->wait.mode = MESSAGE_QUEUE_WAIT_PARK;
+	queue->wait.spins = 0;
+	queue->wait.yields = 0;
+	queue->wait_estimate = 0;
+	queue->stats = NULL;
+	queue->tracing = NULL;
+	queue->priorities = NULL;
+	queue->growth = NULL;
+	queue->selectors = NULL;
+	queue->shards = NULL;
+	queue->num_classes = num_classes - 1;
+	if(queue->num_classes) {
+		if(posix_memalign((void **)&allocators, CACHE_LINE_SIZE, sizeof(struct message_queue_allocator) * queue->num_classes))
+			goto error;
+	}
+	if(options && options->flags) {
+		size_t mapping_size = align_up(memory_size) + align_up(sizeof(struct message_queue_slot) * total_depth) + sizeof(struct message_queue_slot) * queue->max_depth;
+		memory = map_queue_memory(&mapping_size, options);
+		if(!memory)
+			goto error_after_classes;
+		freelists = (char *)memory + align_up(memory_size);
+		queue_data = (char *)freelists + align_up(sizeof(struct message_queue_slot) * total_depth);
+		queue->flags |= MESSAGE_QUEUE_MAPPED;
+		queue->mapping_size = mapping_size;
+	} else {
+		memory = malloc(memory_size);
+		if(!memory)
+			goto error_after_classes;
+		freelists = malloc(sizeof(struct message_queue_slot) * total_depth);
+		if(!freelists)
+			goto error_after_memory;
+		queue_data = malloc(sizeof(struct message_queue_slot) * queue->max_depth);
+		if(!queue_data)
+			goto error_after_freelists;
+	}
+	queue->memory = (intptr_t)memory - (intptr_t)queue;
+	queue->queue_data = (intptr_t)queue_data - (intptr_t)queue;
+	queue->classes = (intptr_t)allocators - (intptr_t)queue;
+	memory_size = 0;
+	total_depth = 0;
+	for(int i=0;i<num_classes;++i) {
+		struct message_queue_allocator *allocator = i < queue->num_classes ? &allocators[i] : &queue->allocator;
+		allocator->message_size = pad_size(classes[i].message_size);
+		allocator->max_depth = round_to_pow2(classes[i].count);
+		allocator->memory = memory_size;
+		allocator->freelist = (intptr_t)((struct message_queue_slot *)freelists + total_depth) - (intptr_t)queue;
+		init_allocator(queue, allocator, lazy);
+		memory_size += (size_t)allocator->message_size * allocator->max_depth;
+		total_depth += allocator->max_depth;
+	}
+	init_ring(queue, lazy);
 	return 0;
 
-error_after_queue:
-	free(queue->queue_data);
-error_after_alloc_sem:
-	sem_close(queue->allocator.sem);
-error_after_freelist:
-	free(queue->freelist);
+error_after_freelists:
+	free(freelists);
 error_after_memory:
-	free(queue->memory);
+	free(memory);
+error_after_classes:
+	free(allocators);
 error:
 	return -1;
 }
 
+struct message_queue *message_queue_create_fd(int fd, int message_size, int max_depth) {
+	struct message_queue *queue;
+	unsigned int padded_size = pad_size(message_size);
+	unsigned int depth = round_to_pow2(max_depth);
+	size_t freelist = align_up(sizeof(struct message_queue));
+	size_t queue_data = freelist + align_up(sizeof(struct message_queue_slot) * depth);
+	size_t memory = queue_data + align_up(sizeof(struct message_queue_slot) * depth);
+	size_t mapping_size = memory + (size_t)padded_size * depth;
+	if(ftruncate(fd, mapping_size))
+		return NULL;
+	queue = mmap(NULL, mapping_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if(queue == MAP_FAILED)
+		return NULL;
+	queue->message_size = padded_size;
+	queue->max_depth = depth;
+	queue->flags = MESSAGE_QUEUE_SHARED;
+	queue->magazine_size = 0;
+	queue->mapping_size = mapping_size;
+	queue->wait.mode = MESSAGE_QUEUE_WAIT_PARK;
+	queue->wait.spins = 0;
+	queue->wait.yields = 0;
+	queue->wait_estimate = 0;
+	queue->stats = NULL;
+	queue->tracing = NULL;
+	queue->priorities = NULL;
+	queue->growth = NULL;
+	queue->selectors = NULL;
+	queue->shards = NULL;
+	queue->memory = memory;
+	queue->queue_data = queue_data;
+	queue->num_classes = 0;
+	queue->classes = 0;
+	queue->allocator.message_size = padded_size;
+	queue->allocator.max_depth = depth;
+	queue->allocator.memory = 0;
+	queue->allocator.freelist = freelist;
+	init_allocator(queue, &queue->allocator, 0);
+	init_ring(queue, 0);
+	memset(&queue->sync, 0, sizeof(queue->sync));
+	__atomic_store_n(&queue->magic, MESSAGE_QUEUE_MAGIC, __ATOMIC_RELEASE);
+	return queue;
+}
+
+struct message_queue *message_queue_attach_fd(int fd) {
+	struct message_queue *queue;
+	struct stat st;
+	if(fstat(fd, &st))
+		return NULL;
+	if(st.st_size < sizeof(struct message_queue)) {
+		errno = EINVAL;
+		return NULL;
+	}
+	queue = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if(queue == MAP_FAILED)
+		return NULL;
+	if(__atomic_load_n(&queue->magic, __ATOMIC_ACQUIRE) != MESSAGE_QUEUE_MAGIC ||
+	   queue->mapping_size != st.st_size) {
+		munmap(queue, st.st_size);
+		errno = EINVAL;
+		return NULL;
+	}
+	return queue;
+}
+
+struct message_queue *message_queue_create_shared(const char *name, int message_size, int max_depth) {
+	struct message_queue *queue;
+	int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+	if(fd < 0)
+		return NULL;
+	queue = message_queue_create_fd(fd, message_size, max_depth);
+	if(!queue)
+		shm_unlink(name);
+	close(fd);
+	return queue;
+}
+
+struct message_queue *message_queue_attach_shared(const char *name) {
+	struct message_queue *queue;
+	int fd = shm_open(name, O_RDWR, 0);
+	if(fd < 0)
+		return NULL;
+	queue = message_queue_attach_fd(fd);
+	close(fd);
+	return queue;
+}
+
+static void drop_magazines(struct message_queue *queue, int flush);
+
+void message_queue_detach_shared(struct message_queue *queue) {
+	drop_magazines(queue, 1);
+	munmap(queue, queue->mapping_size);
+}
+
+struct journal_entry {
+	unsigned int age;
+	intptr_t data;
+};
+
+static int compare_journal_entries(const void *a, const void *b) {
+	unsigned int x = ((const struct journal_entry *)a)->age;
+	unsigned int y = ((const struct journal_entry *)b)->age;
+	return x < y ? 1 : x > y ? -1 : 0;
+}
+
+/*
+ * Rebuilds a queue left behind by a crashed process. A full ring slot
+ * (sequence number lap + 1) holds a message that was written and not yet
+ * read, whatever the counters say; those are moved to the front of the ring
+ * in the order they were written, and every other message goes back on the
+ * freelist.
+ */
+static int recover_journal(struct message_queue *queue) {
+	struct message_queue_slot *ring = queue_ring(queue);
+	struct message_queue_slot *freelist = allocator_freelist(queue, &queue->allocator);
+	unsigned int depth = queue->max_depth;
+	unsigned int writepos = queue->queue.writepos;
+	struct journal_entry *entries = malloc(sizeof(struct journal_entry) * depth);
+	char *live = calloc(depth, 1);
+	unsigned int count = 0, free_count = 0;
+	if(!entries || !live)
+		goto error;
+	for(unsigned int i=0;i<depth;++i) {
+		intptr_t block = ring[i].data / queue->message_size;
+		if((ring[i].seq & (depth - 1)) != 1)
+			continue;
+		// Skip anything that doesn't point to a message of its own
+		if(ring[i].data % queue->message_size || block < 0 || block >= depth || live[block])
+			continue;
+		live[block] = 1;
+		entries[count].age = writepos - (ring[i].seq - 1 + i);
+		entries[count].data = ring[i].data;
+		++count;
+	}
+	qsort(entries, count, sizeof(struct journal_entry), compare_journal_entries);
+	for(unsigned int i=0;i<depth;++i) {
+		ring[i].seq = i < count;
+		ring[i].data = i < count ? entries[i].data : 0;
+		freelist[i].seq = 0;
+	}
+	for(unsigned int i=0;i<depth;++i) {
+		if(!live[i]) {
+			freelist[free_count].seq = 1;
+			freelist[free_count].data = (intptr_t)queue->message_size * i;
+			++free_count;
+		}
+	}
+	queue->flags = MESSAGE_QUEUE_SHARED;
+	queue->magazine_size = 0;
+	queue->wait.mode = MESSAGE_QUEUE_WAIT_PARK;
+	queue->wait.spins = 0;
+	queue->wait.yields = 0;
+	queue->wait_estimate = 0;
+	queue->allocator.wakeup = 0;
+	queue->allocator.blocked_readers = 0;
+	queue->allocator.slot_waiters = 0;
+	queue->allocator.free_blocks = free_count;
+	queue->allocator.fresh_blocks = 0;
+	queue->allocator.allocpos = 0;
+	queue->allocator.freepos = free_count;
+	queue->queue.wakeup = 0;
+	queue->queue.blocked_readers = 0;
+	queue->queue.slot_waiters = 0;
+	queue->queue.entries = count;
+	queue->queue.eventfd = -1;
+	queue->queue.readpos = 0;
+	queue->queue.writepos = count;
+	memset(&queue->sync, 0, sizeof(queue->sync));
+	free(entries);
+	free(live);
+	return msync(queue, queue->mapping_size, MS_SYNC);
+
+error:
+	free(entries);
+	free(live);
+	return -1;
+}
+
+struct message_queue *message_queue_open_journal(const char *path, int message_size, int max_depth) {
+	struct message_queue *queue;
+	struct stat st;
+	// Full and empty slots can only be told apart with at least two of them
+	unsigned int depth = round_to_pow2(max(max_depth, 2));
+	int fd = open(path, O_RDWR | O_CREAT, 0600);
+	if(fd < 0)
+		return NULL;
+	if(fstat(fd, &st))
+		goto error;
+	if(st.st_size == 0) {
+		queue = message_queue_create_fd(fd, message_size, depth);
+		if(!queue)
+			goto error;
+		if(fsync(fd))
+			goto error_after_queue;
+	} else {
+		queue = message_queue_attach_fd(fd);
+		if(!queue)
+			goto error;
+		if(queue->message_size != pad_size(message_size) || queue->max_depth != depth ||
+		   queue->num_classes || queue->allocator.memory) {
+			errno = EINVAL;
+			goto error_after_queue;
+		}
+		if(recover_journal(queue))
+			goto error_after_queue;
+	}
+	close(fd);
+	return queue;
+
+error_after_queue:
+	munmap(queue, queue->mapping_size);
+error:
+	close(fd);
+	return NULL;
+}
+
+/*
+ * Group commit: each caller takes a ticket, and whoever becomes leader
+ * flushes on behalf of every ticket taken before its flush started. The
+ * others wait for a leader to finish and check whether they were covered.
+ */
+int message_queue_sync(struct message_queue *queue) {
+	unsigned int ticket;
+	int shared = queue_shared(queue);
+	if(!(queue->flags & MESSAGE_QUEUE_SHARED)) {
+		errno = EINVAL;
+		return -1;
+	}
+	ticket = __sync_add_and_fetch(&queue->sync.requested, 1);
+	while(1) {
+		unsigned int generation = __atomic_load_n(&queue->sync.generation, __ATOMIC_ACQUIRE);
+		if((int)(__atomic_load_n(&queue->sync.completed, __ATOMIC_ACQUIRE) - ticket) >= 0)
+			return 0;
+		if(__sync_bool_compare_and_swap(&queue->sync.leader, 0, 1)) {
+			unsigned int covered = __atomic_load_n(&queue->sync.requested, __ATOMIC_ACQUIRE);
+			int rv = msync(queue, queue->mapping_size, MS_SYNC);
+			if(!rv)
+				__atomic_store_n(&queue->sync.completed, covered, __ATOMIC_RELEASE);
+			__sync_fetch_and_add(&queue->sync.generation, 1);
+			__atomic_store_n(&queue->sync.leader, 0, __ATOMIC_RELEASE);
+			futex_wake(&queue->sync.generation, INT_MAX, shared);
+			return rv;
+		}
+		futex_wait(&queue->sync.generation, generation, shared);
+	}
+}
+
+/*
+ * Takes up to count never-used blocks, which are contiguous, for a caller
+ * that has already claimed that many from free_blocks. Anything it doesn't
+ * get is on the freelist, or about to be, since fresh blocks run out before
+ * anyone goes to the freelist.
+ */
+static inline int take_fresh(struct message_queue *queue, struct message_queue_allocator *allocator, int count, char **first) {
+	int cur = __atomic_load_n(&allocator->fresh_blocks, __ATOMIC_RELAXED);
+	while(cur > 0) {
+		int n = cur < count ? cur : count;
+		int prev = __sync_val_compare_and_swap(&allocator->fresh_blocks, cur, cur - n);
+		if(prev == cur) {
+			*first = queue_memory(queue) + allocator->memory + (intptr_t)allocator->message_size * (allocator->max_depth - cur);
+			return n;
+		}
+		cur = prev;
+	}
+	return 0;
+}
+
+static void *allocator_alloc(struct message_queue *queue, struct message_queue_allocator *allocator) {
+	if(__sync_fetch_and_add(&allocator->free_blocks, -1) > 0) {
+		char *fresh;
+		if(take_fresh(queue, allocator, 1, &fresh))
+			return fresh;
+		unsigned int pos = __sync_fetch_and_add(&allocator->allocpos, 1);
+		return ring_take(queue, allocator_freelist(queue, allocator), allocator->max_depth, pos, &allocator->slot_waiters);
+	}
+	__sync_fetch_and_add(&allocator->free_blocks, 1);
+	return NULL;
+}
+
+static int allocator_alloc_batch(struct message_queue *queue, struct message_queue_allocator *allocator, void **messages, int count) {
+	int n = claim(&allocator->free_blocks, count);
+	if(n) {
+		char *fresh;
+		int taken = take_fresh(queue, allocator, n, &fresh);
+		for(int i=0;i<taken;++i) {
+			messages[i] = fresh + (intptr_t)allocator->message_size * i;
+		}
+		if(taken < n) {
+			unsigned int pos = __sync_fetch_and_add(&allocator->allocpos, n - taken) - taken;
+			for(int i=taken;i<n;++i) {
+				messages[i] = ring_take(queue, allocator_freelist(queue, allocator), allocator->max_depth, pos + i, &allocator->slot_waiters);
+			}
+		}
+	}
+	return n;
+}
+
+/*
+ * Each class's messages sit together in the queue's memory, in the same
+ * order as the classes, with the largest class last.
+ */
+static inline int allocator_owns(struct message_queue_allocator *allocator, intptr_t offset) {
+	return offset >= allocator->memory && offset < allocator->memory + (intptr_t)allocator->message_size * allocator->max_depth;
+}
+
+static struct message_queue_allocator *segment_allocator(struct message_queue *queue, intptr_t offset) {
+	struct message_queue_growth *growth = queue->growth;
+	unsigned long long active = __atomic_load_n(&growth->active, __ATOMIC_ACQUIRE);
+	for(int i=0;i<MESSAGE_QUEUE_MAX_SEGMENTS;++i) {
+		if((active & (1ULL << i)) && allocator_owns(&growth->segments[i], offset))
+			return &growth->segments[i];
+	}
+	return NULL;
+}
+
+static inline struct message_queue_allocator *message_allocator(struct message_queue *queue, void *message) {
+	intptr_t offset = (char *)message - queue_memory(queue);
+	if(queue->growth && !allocator_owns(&queue->allocator, offset)) {
+		struct message_queue_allocator *segment = segment_allocator(queue, offset);
+		if(segment)
+			return segment;
+	}
+	if(offset >= queue->allocator.memory)
+		return &queue->allocator;
+	struct message_queue_allocator *classes = queue_classes(queue);
+	int i = queue->num_classes - 1;
+	while(i > 0 && offset < classes[i].memory)
+		--i;
+	return &classes[i];
+}
+
+static void growth_put(struct message_queue *queue, void *message) {
+	struct message_queue_growth *growth = queue->growth;
+	struct ring_segment *ring;
+	uint64_t pos;
+	for(;;) {
+		ring = __atomic_load_n(&growth->tail, __ATOMIC_ACQUIRE);
+		pos = __sync_fetch_and_add(&ring->writepos, 1);
+		if(!(pos & RING_SEALED))
+			break;
+		__sync_bool_compare_and_swap(&growth->tail, ring, ring->next);
+	}
+	ring_put(queue, ring->slots, ring->max_depth, (unsigned int)pos, message, &ring->slot_waiters);
+}
+
+static void *growth_take(struct message_queue *queue) {
+	struct message_queue_growth *growth = queue->growth;
+	for(;;) {
+		struct ring_segment *ring = __atomic_load_n(&growth->head, __ATOMIC_ACQUIRE);
+		uint64_t pos = __sync_fetch_and_add(&ring->readpos, 1);
+		uint64_t writepos = __atomic_load_n(&ring->writepos, __ATOMIC_SEQ_CST);
+		if(!(writepos & RING_SEALED) || pos < ring->sealed_at)
+			return ring_take(queue, ring->slots, ring->max_depth, (unsigned int)pos, &ring->slot_waiters);
+		__sync_bool_compare_and_swap(&growth->head, ring, ring->next);
+	}
+}
+
+static inline size_t segment_size(struct message_queue *queue) {
+	return align_up(sizeof(struct message_queue_slot) * queue->allocator.max_depth) + (size_t)queue->allocator.message_size * queue->allocator.max_depth;
+}
+
+/*
+ * Called with the lock held, before the new messages are published, so the
+ * ring always has room for every message.
+ */
+static int grow_ring(struct message_queue_growth *growth) {
+	struct ring_segment *tail = growth->tail, *ring;
+	if(growth->blocks <= tail->max_depth)
+		return 0;
+	if(posix_memalign((void **)&ring, CACHE_LINE_SIZE, sizeof(*ring)))
+		return -1;
+	memset(ring, 0, sizeof(*ring));
+	ring->max_depth = round_to_pow2(growth->blocks);
+	ring->slots = calloc(ring->max_depth, sizeof(struct message_queue_slot));
+	if(!ring->slots) {
+		free(ring);
+		return -1;
+	}
+	__atomic_store_n(&tail->next, ring, __ATOMIC_RELEASE);
+	uint64_t writepos = __atomic_load_n(&tail->writepos, __ATOMIC_RELAXED);
+	do {
+		tail->sealed_at = writepos;
+	} while(!__atomic_compare_exchange_n(&tail->writepos, &writepos, writepos | RING_SEALED, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+	__atomic_store_n(&growth->tail, ring, __ATOMIC_RELEASE);
+	return 0;
+}
+
+static int any_free_blocks(struct message_queue *queue) {
+	struct message_queue_growth *growth = queue->growth;
+	unsigned long long active = __atomic_load_n(&growth->active, __ATOMIC_ACQUIRE);
+	if(__atomic_load_n(&queue->allocator.free_blocks, __ATOMIC_RELAXED) > 0)
+		return 1;
+	for(int i=0;i<MESSAGE_QUEUE_MAX_SEGMENTS;++i) {
+		if((active & (1ULL << i)) && __atomic_load_n(&growth->segments[i].free_blocks, __ATOMIC_RELAXED) > 0)
+			return 1;
+	}
+	return 0;
+}
+
+/*
+ * Adds a segment, unless somebody else has freed or added messages in the
+ * meantime. Returns nonzero if the queue is at its limit.
+ */
+static int grow(struct message_queue *queue) {
+	struct message_queue_growth *growth = queue->growth;
+	struct message_queue_allocator *segment;
+	size_t size = segment_size(queue);
+	void *freelist;
+	int i, rv = -1;
+	pthread_mutex_lock(&growth->lock);
+	if(any_free_blocks(queue)) {
+		rv = 0;
+		goto done;
+	}
+	for(i=0;i<MESSAGE_QUEUE_MAX_SEGMENTS && (growth->active & (1ULL << i));++i);
+	if(i == MESSAGE_QUEUE_MAX_SEGMENTS || growth->memory + size > growth->max_memory)
+		goto done;
+	if(posix_memalign(&freelist, CACHE_LINE_SIZE, size))
+		goto done;
+	growth->blocks += queue->allocator.max_depth;
+	if(grow_ring(growth)) {
+		growth->blocks -= queue->allocator.max_depth;
+		free(freelist);
+		goto done;
+	}
+	segment = &growth->segments[i];
+	segment->message_size = queue->allocator.message_size;
+	segment->max_depth = queue->allocator.max_depth;
+	segment->freelist = (intptr_t)freelist - (intptr_t)queue;
+	segment->memory = ((char *)freelist + align_up(sizeof(struct message_queue_slot) * segment->max_depth)) - queue_memory(queue);
+	struct message_queue_slot *slots = freelist;
+	for(int j=0;j<segment->max_depth;++j) {
+		slots[j].seq = 1;
+		slots[j].data = segment->memory + (intptr_t)segment->message_size * j;
+	}
+	segment->slot_waiters = 0;
+	segment->allocpos = 0;
+	segment->freepos = segment->max_depth;
+	// free_blocks stays 0 until now, since lock-free scans may be touching it
+	__atomic_fetch_or(&growth->active, 1ULL << i, __ATOMIC_SEQ_CST);
+	__sync_fetch_and_add(&segment->free_blocks, segment->max_depth);
+	growth->memory += size;
+	rv = 0;
+done:
+	pthread_mutex_unlock(&growth->lock);
+	return rv;
+}
+
+/*
+ * Takes back a segment whose messages have all been freed, as long as the
+ * queue still has plenty of free messages without it.
+ */
+static void retire_segment(struct message_queue *queue, struct message_queue_allocator *segment) {
+	struct message_queue_growth *growth = queue->growth;
+	if(__atomic_load_n(&queue->allocator.free_blocks, __ATOMIC_RELAXED) < queue->allocator.max_depth / 2)
+		return;
+	if(pthread_mutex_trylock(&growth->lock))
+		return;
+	if(__sync_bool_compare_and_swap(&segment->free_blocks, segment->max_depth, 0)) {
+		__atomic_fetch_and(&growth->active, ~(1ULL << (segment - growth->segments)), __ATOMIC_SEQ_CST);
+		free(allocator_freelist(queue, segment));
+		growth->blocks -= segment->max_depth;
+		growth->memory -= segment_size(queue);
+	}
+	pthread_mutex_unlock(&growth->lock);
+}
+
+static void *growth_alloc(struct message_queue *queue) {
+	struct message_queue_growth *growth = queue->growth;
+	do {
+		unsigned long long active = __atomic_load_n(&growth->active, __ATOMIC_ACQUIRE);
+		for(int i=0;i<MESSAGE_QUEUE_MAX_SEGMENTS;++i) {
+			if(active & (1ULL << i)) {
+				void *rv = allocator_alloc(queue, &growth->segments[i]);
+				if(rv)
+					return rv;
+			}
+		}
+		void *rv = allocator_alloc(queue, &queue->allocator);
+		if(rv)
+			return rv;
+	} while(!grow(queue));
+	return NULL;
+}
+
+static void segment_free(struct message_queue *queue, struct message_queue_allocator *segment, void *message) {
+	unsigned int pos = __sync_fetch_and_add(&segment->freepos, 1);
+	ring_put(queue, allocator_freelist(queue, segment), segment->max_depth, pos, message, &segment->slot_waiters);
+	int free_blocks = __sync_fetch_and_add(&segment->free_blocks, 1) + 1;
+	// Blocked allocators all wait on the main allocator
+	wake_blocked_readers(queue, &queue->allocator.wakeup, &queue->allocator.blocked_readers, 1);
+	if(free_blocks == segment->max_depth)
+		retire_segment(queue, segment);
+}
+
+static void allocator_free_batch(struct message_queue *queue, struct message_queue_allocator *allocator, void **messages, int count) {
+	unsigned int pos = __sync_fetch_and_add(&allocator->freepos, count);
+	for(int i=0;i<count;++i) {
+		ring_put(queue, allocator_freelist(queue, allocator), allocator->max_depth, pos + i, messages[i], &allocator->slot_waiters);
+	}
+	__sync_fetch_and_add(&allocator->free_blocks, count);
+	wake_blocked_readers(queue, &allocator->wakeup, &allocator->blocked_readers, count);
+}
+
+/*
+ * Returns messages straight to the freelists of their own classes or
+ * segments. Unlike message_queue_message_free_batch, this never goes
+ * through a magazine, so the magazine code can flush with it.
+ */
+static void return_messages(struct message_queue *queue, void **messages, int count) {
+	if(count <= 0)
+		return;
+	if(!queue->num_classes && !queue->growth) {
+		allocator_free_batch(queue, &queue->allocator, messages, count);
+		return;
+	}
+	for(int i=0;i<count;++i) {
+		struct message_queue_allocator *allocator = message_allocator(queue, messages[i]);
+		if(queue->growth && allocator >= queue->growth->segments && allocator < queue->growth->segments + MESSAGE_QUEUE_MAX_SEGMENTS)
+			segment_free(queue, allocator, messages[i]);
+		else
+			allocator_free_batch(queue, allocator, &messages[i], 1);
+	}
+}
+
+/*
+ * Per-thread magazines. Each thread has a handful of magazines, looked up by
+ * queue; the owning thread is the only one that touches a magazine's
+ * contents while the queue is in use. All the thread caches are also kept on
+ * a list so that queues can reclaim their magazines when they're torn down,
+ * and so that a thread's magazines can be flushed when it exits.
+ */
+struct magazine {
+	struct message_queue *queue;
+	int count;
+	void *messages[MESSAGE_QUEUE_MAGAZINE_MAX];
+};
+
+struct magazine_cache {
+	struct magazine_cache *next, *prev;
+	struct magazine magazines[MAGAZINES_PER_THREAD];
+};
+
+static pthread_mutex_t magazine_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct magazine_cache *magazine_caches;
+static pthread_key_t magazine_key;
+static pthread_once_t magazine_once = PTHREAD_ONCE_INIT;
+static __thread struct magazine_cache *thread_magazines;
+
+static void magazine_cache_destroy(void *data) {
+	struct magazine_cache *cache = data;
+	pthread_mutex_lock(&magazine_lock);
+	for(int i=0;i<MAGAZINES_PER_THREAD;++i) {
+		struct magazine *magazine = &cache->magazines[i];
+		if(magazine->queue)
+			return_messages(magazine->queue, magazine->messages, magazine->count);
+	}
+	if(cache->prev)
+		cache->prev->next = cache->next;
+	else
+		magazine_caches = cache->next;
+	if(cache->next)
+		cache->next->prev = cache->prev;
+	pthread_mutex_unlock(&magazine_lock);
+	thread_magazines = NULL;
+	free(cache);
+}
+
+static void magazine_key_create() {
+	pthread_key_create(&magazine_key, &magazine_cache_destroy);
+}
+
+static struct magazine *thread_magazine(struct message_queue *queue) {
+	struct magazine_cache *cache = thread_magazines;
+	struct magazine *magazine;
+	if(cache) {
+		for(int i=0;i<MAGAZINES_PER_THREAD;++i) {
+			if(__atomic_load_n(&cache->magazines[i].queue, __ATOMIC_RELAXED) == queue)
+				return &cache->magazines[i];
+		}
+	} else {
+		pthread_once(&magazine_once, &magazine_key_create);
+		cache = calloc(1, sizeof(struct magazine_cache));
+		if(!cache)
+			return NULL;
+		pthread_mutex_lock(&magazine_lock);
+		cache->next = magazine_caches;
+		if(magazine_caches)
+			magazine_caches->prev = cache;
+		magazine_caches = cache;
+		pthread_mutex_unlock(&magazine_lock);
+		pthread_setspecific(magazine_key, cache);
+		thread_magazines = cache;
+	}
+	// Take an unused magazine, or evict one picked by the queue's address
+	pthread_mutex_lock(&magazine_lock);
+	magazine = &cache->magazines[((uintptr_t)queue / sizeof(struct message_queue)) % MAGAZINES_PER_THREAD];
+	for(int i=0;i<MAGAZINES_PER_THREAD;++i) {
+		if(!cache->magazines[i].queue) {
+			magazine = &cache->magazines[i];
+			break;
+		}
+	}
+	if(magazine->queue)
+		return_messages(magazine->queue, magazine->messages, magazine->count);
+	magazine->count = 0;
+	__atomic_store_n(&magazine->queue, queue, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&magazine_lock);
+	return magazine;
+}
+
+/*
+ * Forget every thread's magazine for a queue, returning the messages in
+ * them to the queue first if flush is set.
+ */
+static void drop_magazines(struct message_queue *queue, int flush) {
+	if(!queue->magazine_size)
+		return;
+	pthread_mutex_lock(&magazine_lock);
+	for(struct magazine_cache *cache=magazine_caches;cache;cache=cache->next) {
+		for(int i=0;i<MAGAZINES_PER_THREAD;++i) {
+			struct magazine *magazine = &cache->magazines[i];
+			if(magazine->queue == queue) {
+				if(flush)
+					return_messages(queue, magazine->messages, magazine->count);
+				magazine->count = 0;
+				__atomic_store_n(&magazine->queue, NULL, __ATOMIC_RELAXED);
+			}
+		}
+	}
+	pthread_mutex_unlock(&magazine_lock);
+}
+
+static void *magazine_alloc(struct message_queue *queue) {
+	struct magazine *magazine = thread_magazine(queue);
+	if(!magazine)
+		return allocator_alloc(queue, &queue->allocator);
+	if(!magazine->count) {
+		magazine->count = allocator_alloc_batch(queue, &queue->allocator, magazine->messages, (queue->magazine_size + 1) / 2);
+		if(!magazine->count)
+			return NULL;
+	}
+	return magazine->messages[--magazine->count];
+}
+
+/*
+ * Messages go back to the shared freelist half a magazine at a time, or all
+ * at once if anybody is waiting for one.
+ */
+static void magazine_free(struct message_queue *queue, void *message) {
+	struct magazine *magazine = thread_magazine(queue);
+	if(!magazine) {
+		return_messages(queue, &message, 1);
+		return;
+	}
+	magazine->messages[magazine->count++] = message;
+	if(__atomic_load_n(&queue->allocator.blocked_readers, __ATOMIC_RELAXED)) {
+		return_messages(queue, magazine->messages, magazine->count);
+		magazine->count = 0;
+	} else if(magazine->count >= queue->magazine_size) {
+		int flush = queue->magazine_size / 2;
+		magazine->count -= flush;
+		return_messages(queue, magazine->messages + magazine->count, flush);
+	}
+}
+
+void message_queue_enable_magazines(struct message_queue *queue, int size) {
+	if(size > MESSAGE_QUEUE_MAGAZINE_MAX)
+		size = MESSAGE_QUEUE_MAGAZINE_MAX;
+	if(size > queue->allocator.max_depth / 2)
+		size = queue->allocator.max_depth / 2;
+	if(size < 2)
+		size = 0;
+	if(!size)
+		drop_magazines(queue, 1);
+	queue->magazine_size = size;
+}
+
+void message_queue_magazine_flush(struct message_queue *queue) {
+	struct magazine_cache *cache = thread_magazines;
+	if(!cache)
+		return;
+	for(int i=0;i<MAGAZINES_PER_THREAD;++i) {
+		struct magazine *magazine = &cache->magazines[i];
+		if(magazine->queue == queue) {
+			return_messages(queue, magazine->messages, magazine->count);
+			magazine->count = 0;
+		}
+	}
+}
+
 void *message_queue_message_alloc(struct message_queue *queue) {
-	if(__sync_fetch_and_add(&queue->allocator.free_blocks, -1) > 0) {
-		unsigned int pos = __sync_fetch_and_add(&queue->allocator.allocpos, 1) % queue->max_depth;
-		void *rv = queue->freelist[pos];
-		while(!rv) {
-			usleep(10); __sync_synchronize();
-			rv = queue->freelist[pos];
-		}
-		queue->freelist[pos] = NULL;
-		return rv;
+	void *rv = queue->magazine_size ? magazine_alloc(queue) : allocator_alloc(queue, &queue->allocator);
+	if(!rv && queue->growth)
+		rv = growth_alloc(queue);
+	if(!rv)
+		COUNT_STAT(queue, failed_allocs, 1);
+	return rv;
+}
+
+void *message_queue_message_alloc_sized(struct message_queue *queue, int size) {
+	struct message_queue_allocator *classes = queue_classes(queue);
+	for(int i=0;i<queue->num_classes;++i) {
+		if(size <= classes[i].message_size) {
+			void *rv = allocator_alloc(queue, &classes[i]);
+			if(rv)
+				return rv;
+		}
 	}
-	__sync_fetch_and_add(&queue->allocator.free_blocks, 1);
+	if(size <= queue->allocator.message_size) {
+		void *rv = allocator_alloc(queue, &queue->allocator);
+		if(!rv && queue->growth)
+			rv = growth_alloc(queue);
+		if(rv)
+			return rv;
+	}
+	COUNT_STAT(queue, failed_allocs, 1);
 	return NULL;
 }
 
+/*
+ * A blocking call that finds nothing to do calls wait_idle() before each
+ * retry, until it returns nonzero to say the queue's policy is done spinning
+ * and yielding and the caller should sleep.
+ */
+struct wait_state {
+	int spins;
+	int yields;
+};
+
+static int wait_idle(struct message_queue *queue, struct wait_state *state) {
+	int limit = queue->wait.spins;
+	switch(queue->wait.mode) {
+	case MESSAGE_QUEUE_WAIT_PARK:
+		return 1;
+	case MESSAGE_QUEUE_WAIT_SPIN:
+		cpu_relax();
+		return 0;
+	case MESSAGE_QUEUE_WAIT_ADAPTIVE:
+		limit = __atomic_load_n(&queue->wait_estimate, __ATOMIC_RELAXED);
+		break;
+	}
+	if(state->spins < limit) {
+		++state->spins;
+		cpu_relax();
+		return 0;
+	}
+	if(state->yields < queue->wait.yields) {
+		++state->yields;
+		sched_yield();
+		return 0;
+	}
+	return 1;
+}
+
+/*
+ * Adaptive queues move their spin estimate an eighth of the way towards twice
+ * what this wait took, or towards nothing if it had to sleep. Racing updates
+ * just lose a sample.
+ */
+static void wait_done(struct message_queue *queue, struct wait_state *state, int parked) {
+	int estimate, target;
+	if(queue->wait.mode != MESSAGE_QUEUE_WAIT_ADAPTIVE)
+		return;
+	estimate = __atomic_load_n(&queue->wait_estimate, __ATOMIC_RELAXED);
+	target = parked ? 0 : state->spins * 2;
+	estimate += (target - estimate) / 8;
+	if(estimate < WAIT_MIN_SPINS)
+		estimate = WAIT_MIN_SPINS;
+	if(estimate > queue->wait.spins)
+		estimate = queue->wait.spins;
+	__atomic_store_n(&queue->wait_estimate, estimate, __ATOMIC_RELAXED);
+}
+
+int message_queue_set_wait_policy(struct message_queue *queue, const struct message_queue_wait_policy *policy) {
+	if(policy->mode < MESSAGE_QUEUE_WAIT_PARK || policy->mode > MESSAGE_QUEUE_WAIT_ADAPTIVE || policy->spins < 0 || policy->yields < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	queue->wait = *policy;
+	queue->wait_estimate = policy->spins;
+	return 0;
+}
+
 void *message_queue_message_alloc_blocking(struct message_queue *queue) {
+	struct wait_state state = {0, 0};
 	void *rv = message_queue_message_alloc(queue);
+	if(rv)
+		return rv;
+	while(!wait_idle(queue, &state)) {
+		if((rv = message_queue_message_alloc(queue))) {
+			wait_done(queue, &state, 0);
+			return rv;
+		}
+	}
 	while(!rv) {
+		unsigned int wakeup = __atomic_load_n(&queue->allocator.wakeup, __ATOMIC_ACQUIRE);
 		__sync_fetch_and_add(&queue->allocator.blocked_readers, 1);
 		rv = message_queue_message_alloc(queue);
-		if(rv) {
-			__sync_fetch_and_add(&queue->allocator.blocked_readers, -1);
-			return rv;
+		if(!rv) {
+			COUNT_STAT(queue, parks, 1);
+			futex_wait(&queue->allocator.wakeup, wakeup, queue_shared(queue));
 		}
-		while(sem_wait(queue->allocator.sem) && errno == EINTR);
-		rv = message_queue_message_alloc(queue);
+		__sync_fetch_and_add(&queue->allocator.blocked_readers, -1);
+		if(!rv)
+			rv = message_queue_message_alloc(queue);
 	}
+	wait_done(queue, &state, 1);
 	return rv;
 }
 
+int message_queue_message_alloc_batch(struct message_queue *queue, void **messages, int count) {
+	if(count <= 0)
+		return 0;
+	int n = allocator_alloc_batch(queue, &queue->allocator, messages, count);
+	while(n < count && queue->growth && (messages[n] = growth_alloc(queue)))
+		++n;
+	if(!n)
+		COUNT_STAT(queue, failed_allocs, 1);
+	return n;
+}
+
 void message_queue_message_free(struct message_queue *queue, void *message) {
-	unsigned int pos = __sync_fetch_and_add(&queue->allocator.freepos, 1) % queue->max_depth;
-	void *cur = queue->freelist[pos];
-	while(cur) {
-		usleep(10); __sync_synchronize();
-		cur = queue->freelist[pos];
-	}
-	queue->freelist[pos] = message;
-	__sync_fetch_and_add(&queue->allocator.free_blocks, 1);
-	if(queue->allocator.blocked_readers) {
-		__sync_fetch_and_add(&queue->allocator.blocked_readers, -1);
-		sem_post(queue->allocator.sem);
+	struct message_queue_allocator *allocator = message_allocator(queue, message);
+	if(queue->magazine_size && allocator == &queue->allocator) {
+		magazine_free(queue, message);
+		return;
+	}
+	if(queue->growth && allocator >= queue->growth->segments && allocator < queue->growth->segments + MESSAGE_QUEUE_MAX_SEGMENTS) {
+		segment_free(queue, allocator, message);
+		return;
+	}
+	allocator_free_batch(queue, allocator, &message, 1);
+}
+
+void message_queue_message_free_batch(struct message_queue *queue, void **messages, int count) {
+	if(count <= 0)
+		return;
+	if(queue->num_classes || queue->growth) {
+		for(int i=0;i<count;++i) {
+			message_queue_message_free(queue, messages[i]);
+		}
+		return;
+	}
+	allocator_free_batch(queue, &queue->allocator, messages, count);
+}
+
+static int queue_depth(struct message_queue *queue) {
+	int depth = 0;
+	if(!queue->shards)
+		return __atomic_load_n(&queue->queue.entries, __ATOMIC_SEQ_CST);
+	for(int i=0;i<queue->shards->count;++i) {
+		depth += max(__atomic_load_n(&queue->shards->shards[i].entries, __ATOMIC_SEQ_CST), 0);
+	}
+	return depth;
+}
+
+/*
+ * Makes count newly written messages visible to readers, and wakes whoever
+ * is waiting for them. counter is queue.entries, or a shard's count; the
+ * high water mark is for the whole queue either way.
+ */
+static inline void publish_to(struct message_queue *queue, int *counter, int count) {
+	int entries = __sync_fetch_and_add(counter, count);
+	signal_eventfd(queue, entries);
+	if(queue->stats)
+		count_enqueues(queue, counter == &queue->queue.entries ? entries + count : queue_depth(queue), count);
+	wake_blocked_readers(queue, &queue->queue.wakeup, &queue->queue.blocked_readers, count);
+	wake_selectors(queue);
+}
+
+static inline void publish_entries(struct message_queue *queue, int count) {
+	publish_to(queue, &queue->queue.entries, count);
+}
+
+static void shard_put(struct message_queue *queue, void **messages, int count) {
+	struct message_queue_lane *shard = &queue->shards->shards[home_shard(queue)];
+	unsigned int pos = __sync_fetch_and_add(&shard->writepos, count);
+	for(int i=0;i<count;++i) {
+		ring_put(queue, shard->ring, queue->max_depth, pos + i, messages[i], &shard->slot_waiters);
+	}
+	publish_to(queue, &shard->entries, count);
+}
+
+/*
+ * Takes up to max messages, from the home shard first and then from the
+ * others in turn. Empty shards are skipped with a plain load.
+ */
+static int shard_take(struct message_queue *queue, void **messages, int max) {
+	struct message_queue_shards *shards = queue->shards;
+	int home = home_shard(queue), n = 0;
+	for(int i=0;i<shards->count && n < max;++i) {
+		struct message_queue_lane *shard = &shards->shards[(home + i) % shards->count];
+		int taken;
+		if(__atomic_load_n(&shard->entries, __ATOMIC_SEQ_CST) <= 0)
+			continue;
+		taken = claim(&shard->entries, max - n);
+		if(taken) {
+			unsigned int pos = __sync_fetch_and_add(&shard->readpos, taken);
+			for(int j=0;j<taken;++j) {
+				messages[n + j] = ring_take(queue, shard->ring, queue->max_depth, pos + j, &shard->slot_waiters);
+			}
+			n += taken;
+		}
 	}
+	if(n)
+		COUNT_STAT(queue, dequeues, n);
+	return n;
 }
 
 void message_queue_write(struct message_queue *queue, void *message) {
-	unsigned int pos = __sync_fetch_and_add(&queue->queue.writepos, 1) % queue->max_depth;
-	void *cur = queue->queue_data[pos];
-	while(cur) {
-		usleep(10); __sync_synchronize();
-		cur = queue->queue_data[pos];
+	if(queue->shards) {
+		shard_put(queue, &message, 1);
+		return;
 	}
-	queue->queue_data[pos] = message;
-	__sync_fetch_and_add(&queue->queue.entries, 1);
-	if(queue->queue.blocked_readers) {
-		__sync_fetch_and_add(&queue->queue.blocked_readers, -1);
-		sem_post(queue->queue.sem);
+	if(queue->priorities) {
+		message_queue_write_prio(queue, message, 0);
+		return;
+	}
+	if(queue->growth) {
+		growth_put(queue, message);
+	} else {
+		uint64_t now = trace_now(queue);
+		unsigned int pos = __sync_fetch_and_add(&queue->queue.writepos, 1);
+		queue_put(queue, pos, message, now);
 	}
+	publish_entries(queue, 1);
+}
+
+void message_queue_write_batch(struct message_queue *queue, void **messages, int count) {
+	if(count <= 0)
+		return;
+	if(queue->shards) {
+		shard_put(queue, messages, count);
+		return;
+	}
+	if(queue->priorities) {
+		lane_put(queue, 0, messages, count);
+	} else if(queue->growth) {
+		for(int i=0;i<count;++i) {
+			growth_put(queue, messages[i]);
+		}
+	} else {
+		uint64_t now = trace_now(queue);
+		unsigned int pos = __sync_fetch_and_add(&queue->queue.writepos, count);
+		for(int i=0;i<count;++i) {
+			queue_put(queue, pos + i, messages[i], now);
+		}
+	}
+	publish_entries(queue, count);
+}
+
+void message_queue_write_prio(struct message_queue *queue, void *message, int priority) {
+	lane_put(queue, priority, &message, 1);
+	publish_entries(queue, 1);
 }
 
 void *message_queue_tryread(struct message_queue *queue) {
+	void *rv;
+	if(queue->shards)
+		return shard_take(queue, &rv, 1) ? rv : NULL;
 	if(__sync_fetch_and_add(&queue->queue.entries, -1) > 0) {
-		unsigned int pos = __sync_fetch_and_add(&queue->queue.readpos, 1) % queue->max_depth;
-		void *rv = queue->queue_data[pos];
-		while(!rv) {
-			usleep(10); __sync_synchronize();
-			rv = queue->queue_data[pos];
-		}
-		queue->queue_data[pos] = NULL;
-		return rv;
+		COUNT_STAT(queue, dequeues, 1);
+		if(queue->priorities)
+			return lane_take(queue);
+		if(queue->growth)
+			return growth_take(queue);
+		unsigned int pos = __sync_fetch_and_add(&queue->queue.readpos, 1);
+		return queue_take(queue, pos, trace_now(queue));
 	}
 	__sync_fetch_and_add(&queue->queue.entries, 1);
 	return NULL;
 }
 
 void *message_queue_read(struct message_queue *queue) {
+	struct wait_state state = {0, 0};
 	void *rv = message_queue_tryread(queue);
+	if(rv)
+		return rv;
+	// Spinning readers never reach the flush before sleeping below
+	if(queue->magazine_size && queue->wait.mode == MESSAGE_QUEUE_WAIT_SPIN)
+		message_queue_magazine_flush(queue);
+	while(!wait_idle(queue, &state)) {
+		if((rv = message_queue_tryread(queue))) {
+			wait_done(queue, &state, 0);
+			return rv;
+		}
+	}
 	while(!rv) {
+		unsigned int wakeup = __atomic_load_n(&queue->queue.wakeup, __ATOMIC_ACQUIRE);
 		__sync_fetch_and_add(&queue->queue.blocked_readers, 1);
 		rv = message_queue_tryread(queue);
-		if(rv) {
-			__sync_fetch_and_add(&queue->queue.blocked_readers, -1);
-			return rv;
+		if(!rv) {
+			// Don't sit on free messages that a writer might be waiting for
+			if(queue->magazine_size)
+				message_queue_magazine_flush(queue);
+			COUNT_STAT(queue, parks, 1);
+			futex_wait(&queue->queue.wakeup, wakeup, queue_shared(queue));
 		}
-		while(sem_wait(queue->queue.sem) && errno == EINTR);
-		rv = message_queue_tryread(queue);
+		__sync_fetch_and_add(&queue->queue.blocked_readers, -1);
+		if(!rv)
+			rv = message_queue_tryread(queue);
 	}
+	wait_done(queue, &state, 1);
 	return rv;
 }
 
+int message_queue_tryread_batch(struct message_queue *queue, void **messages, int max) {
+	if(max <= 0)
+		return 0;
+	if(queue->shards)
+		return shard_take(queue, messages, max);
+	int n = claim(&queue->queue.entries, max);
+	if(n && (queue->priorities || queue->growth)) {
+		COUNT_STAT(queue, dequeues, n);
+		for(int i=0;i<n;++i) {
+			messages[i] = queue->priorities ? lane_take(queue) : growth_take(queue);
+		}
+	} else if(n) {
+		uint64_t now = trace_now(queue);
+		unsigned int pos = __sync_fetch_and_add(&queue->queue.readpos, n);
+		COUNT_STAT(queue, dequeues, n);
+		for(int i=0;i<n;++i) {
+			messages[i] = queue_take(queue, pos + i, now);
+		}
+	}
+	return n;
+}
+
+int message_queue_read_batch(struct message_queue *queue, void **messages, int max) {
+	struct wait_state state = {0, 0};
+	if(max <= 0)
+		return 0;
+	int n = message_queue_tryread_batch(queue, messages, max);
+	if(n)
+		return n;
+	if(queue->magazine_size && queue->wait.mode == MESSAGE_QUEUE_WAIT_SPIN)
+		message_queue_magazine_flush(queue);
+	while(!wait_idle(queue, &state)) {
+		if((n = message_queue_tryread_batch(queue, messages, max))) {
+			wait_done(queue, &state, 0);
+			return n;
+		}
+	}
+	while(!n) {
+		unsigned int wakeup = __atomic_load_n(&queue->queue.wakeup, __ATOMIC_ACQUIRE);
+		__sync_fetch_and_add(&queue->queue.blocked_readers, 1);
+		n = message_queue_tryread_batch(queue, messages, max);
+		if(!n) {
+			// Don't sit on free messages that a writer might be waiting for
+			if(queue->magazine_size)
+				message_queue_magazine_flush(queue);
+			COUNT_STAT(queue, parks, 1);
+			futex_wait(&queue->queue.wakeup, wakeup, queue_shared(queue));
+		}
+		__sync_fetch_and_add(&queue->queue.blocked_readers, -1);
+		if(!n)
+			n = message_queue_tryread_batch(queue, messages, max);
+	}
+	wait_done(queue, &state, 1);
+	return n;
+}
+
+static struct message_queue_selectors *queue_selectors(struct message_queue *queue) {
+	struct message_queue_selectors *selectors = __atomic_load_n(&queue->selectors, __ATOMIC_ACQUIRE);
+	if(selectors)
+		return selectors;
+	selectors = calloc(1, sizeof(*selectors));
+	if(!selectors)
+		return NULL;
+	pthread_mutex_init(&selectors->lock, NULL);
+	if(!__sync_bool_compare_and_swap(&queue->selectors, NULL, selectors)) {
+		pthread_mutex_destroy(&selectors->lock);
+		free(selectors);
+	}
+	return queue->selectors;
+}
+
+static void select_register(struct message_queue_selectors *selectors, struct select_waiter *waiter) {
+	pthread_mutex_lock(&selectors->lock);
+	waiter->prev = NULL;
+	waiter->next = selectors->waiters;
+	if(waiter->next)
+		waiter->next->prev = waiter;
+	selectors->waiters = waiter;
+	__sync_fetch_and_add(&selectors->waiting, 1);
+	pthread_mutex_unlock(&selectors->lock);
+}
+
+static void select_unregister(struct message_queue_selectors *selectors, struct select_waiter *waiter) {
+	pthread_mutex_lock(&selectors->lock);
+	if(waiter->prev)
+		waiter->prev->next = waiter->next;
+	else
+		selectors->waiters = waiter->next;
+	if(waiter->next)
+		waiter->next->prev = waiter->prev;
+	__sync_fetch_and_add(&selectors->waiting, -1);
+	pthread_mutex_unlock(&selectors->lock);
+}
+
+static int select_ready(struct message_queue **queues, int count) {
+	for(int i=0;i<count;++i) {
+		if(queue_depth(queues[i]) > 0)
+			return i;
+	}
+	return -1;
+}
+
+int message_queue_select(struct message_queue **queues, int count, int timeout) {
+	struct message_queue_selectors *selectors[count];
+	struct select_waiter waiters[count];
+	struct timespec deadline, now, remaining;
+	unsigned int wakeup = 0;
+	int ready;
+	if(count < 1) {
+		errno = EINVAL;
+		return -1;
+	}
+	ready = select_ready(queues, count);
+	if(ready >= 0)
+		return ready;
+	if(!timeout) {
+		errno = ETIMEDOUT;
+		return -1;
+	}
+	for(int i=0;i<count;++i) {
+		if(queue_shared(queues[i])) {
+			errno = EINVAL;
+			return -1;
+		}
+		selectors[i] = queue_selectors(queues[i]);
+		if(!selectors[i])
+			return -1;
+		waiters[i].wakeup = &wakeup;
+	}
+	if(timeout > 0) {
+		clock_gettime(CLOCK_MONOTONIC, &deadline);
+		deadline.tv_sec += timeout / 1000;
+		deadline.tv_nsec += (timeout % 1000) * 1000000L;
+		if(deadline.tv_nsec >= 1000000000L) {
+			deadline.tv_nsec -= 1000000000L;
+			++deadline.tv_sec;
+		}
+	}
+	while(ready < 0) {
+		unsigned int seen = __atomic_load_n(&wakeup, __ATOMIC_ACQUIRE);
+		for(int i=0;i<count;++i) {
+			select_register(selectors[i], &waiters[i]);
+		}
+		ready = select_ready(queues, count);
+		if(ready < 0) {
+			// Don't sit on free messages that a writer might be waiting for
+			for(int i=0;i<count;++i) {
+				if(queues[i]->magazine_size)
+					message_queue_magazine_flush(queues[i]);
+			}
+			COUNT_STAT(queues[0], parks, 1);
+			if(timeout > 0) {
+				clock_gettime(CLOCK_MONOTONIC, &now);
+				remaining.tv_sec = deadline.tv_sec - now.tv_sec;
+				remaining.tv_nsec = deadline.tv_nsec - now.tv_nsec;
+				if(remaining.tv_nsec < 0) {
+					remaining.tv_nsec += 1000000000L;
+					--remaining.tv_sec;
+				}
+				if(remaining.tv_sec >= 0)
+					futex_wait_timeout(&wakeup, seen, 0, &remaining);
+			} else {
+				futex_wait(&wakeup, seen, 0);
+			}
+		}
+		for(int i=0;i<count;++i) {
+			select_unregister(selectors[i], &waiters[i]);
+		}
+		if(ready < 0)
+			ready = select_ready(queues, count);
+		if(ready < 0 && timeout > 0) {
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			if(now.tv_sec > deadline.tv_sec || (now.tv_sec == deadline.tv_sec && now.tv_nsec >= deadline.tv_nsec)) {
+				errno = ETIMEDOUT;
+				return -1;
+			}
+		}
+	}
+	return ready;
+}
+
+int message_queue_get_fd(struct message_queue *queue) {
+#ifdef __linux__
+	int fd = __atomic_load_n(&queue->queue.eventfd, __ATOMIC_ACQUIRE);
+	if(fd >= 0)
+		return fd;
+	if(queue_shared(queue)) {
+		errno = EINVAL;
+		return -1;
+	}
+	fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if(fd < 0)
+		return -1;
+	if(!__sync_bool_compare_and_swap(&queue->queue.eventfd, -1, fd)) {
+		close(fd);
+		return queue->queue.eventfd;
+	}
+	// Anything written before the descriptor existed didn't signal it
+	if(queue_depth(queue) > 0) {
+		uint64_t one = 1;
+		write(fd, &one, sizeof(one));
+	}
+	return fd;
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+int message_queue_enable_stats(struct message_queue *queue) {
+	struct message_queue_stats_shard *stats;
+	if(queue->stats)
+		return 0;
+	if(queue_shared(queue)) {
+		errno = EINVAL;
+		return -1;
+	}
+	if(posix_memalign((void **)&stats, CACHE_LINE_SIZE, sizeof(struct message_queue_stats_shard) * STATS_SHARDS))
+		return -1;
+	memset(stats, 0, sizeof(struct message_queue_stats_shard) * STATS_SHARDS);
+	if(!__sync_bool_compare_and_swap(&queue->stats, NULL, stats))
+		free(stats);
+	return 0;
+}
+
+int message_queue_enable_tracing(struct message_queue *queue) {
+	struct message_queue_tracing *tracing;
+	if(queue->tracing)
+		return 0;
+	if(queue_shared(queue) || queue->priorities || queue->growth || queue->shards) {
+		errno = EINVAL;
+		return -1;
+	}
+	if(posix_memalign((void **)&tracing, CACHE_LINE_SIZE, sizeof(*tracing)))
+		return -1;
+	memset(tracing, 0, sizeof(*tracing));
+	tracing->stamps = calloc(queue->max_depth, sizeof(uint64_t));
+	if(!tracing->stamps) {
+		free(tracing);
+		return -1;
+	}
+	__atomic_store_n(&queue->tracing, tracing, __ATOMIC_RELEASE);
+	return 0;
+}
+
+void message_queue_latency_snapshot(struct message_queue *queue, struct message_queue_latency *latency) {
+	struct message_queue_tracing *tracing = queue->tracing;
+	uint64_t buckets[TRACE_BUCKETS] = {0};
+	uint64_t seen = 0;
+	double targets[] = {50, 90, 99, 99.9};
+	uint64_t *results[] = {&latency->p50, &latency->p90, &latency->p99, &latency->p999};
+	int next = 0;
+	memset(latency, 0, sizeof(*latency));
+	if(!tracing)
+		return;
+	for(int i=0;i<STATS_SHARDS;++i) {
+		for(int j=0;j<TRACE_BUCKETS;++j) {
+			uint64_t count = __atomic_load_n(&tracing->shards[i].buckets[j], __ATOMIC_RELAXED);
+			buckets[j] += count;
+			latency->count += count;
+		}
+	}
+	for(int i=0;i<TRACE_BUCKETS;++i) {
+		if(!buckets[i])
+			continue;
+		seen += buckets[i];
+		while(next < 4 && seen > latency->count * targets[next] / 100)
+			*results[next++] = trace_bucket_max(i);
+		latency->max = trace_bucket_max(i);
+	}
+}
+
+void message_queue_get_stats(struct message_queue *queue, struct message_queue_stats *stats) {
+	struct message_queue_stats_shard *shards = queue->stats;
+	memset(stats, 0, sizeof(*stats));
+	stats->depth = max(queue_depth(queue), 0);
+	stats->free_blocks = max(__atomic_load_n(&queue->allocator.free_blocks, __ATOMIC_RELAXED), 0);
+	if(!shards)
+		return;
+	for(int i=0;i<STATS_SHARDS;++i) {
+		stats->enqueues += __atomic_load_n(&shards[i].enqueues, __ATOMIC_RELAXED);
+		stats->dequeues += __atomic_load_n(&shards[i].dequeues, __ATOMIC_RELAXED);
+		stats->failed_allocs += __atomic_load_n(&shards[i].failed_allocs, __ATOMIC_RELAXED);
+		stats->spins += __atomic_load_n(&shards[i].spins, __ATOMIC_RELAXED);
+		stats->parks += __atomic_load_n(&shards[i].parks, __ATOMIC_RELAXED);
+		stats->wakes += __atomic_load_n(&shards[i].wakes, __ATOMIC_RELAXED);
+		stats->high_water = max(stats->high_water, __atomic_load_n(&shards[i].high_water, __ATOMIC_RELAXED));
+	}
+}
+
+int message_queue_enable_priorities(struct message_queue *queue, int levels) {
+	struct message_queue_priorities *priorities;
+	if(queue_shared(queue) || queue->priorities || queue->growth || queue->tracing || queue->shards || levels < 1 || levels > MESSAGE_QUEUE_MAX_PRIORITIES) {
+		errno = EINVAL;
+		return -1;
+	}
+	if(posix_memalign((void **)&priorities, CACHE_LINE_SIZE, sizeof(*priorities) + sizeof(struct message_queue_lane) * levels))
+		return -1;
+	memset(priorities, 0, sizeof(*priorities) + sizeof(struct message_queue_lane) * levels);
+	priorities->levels = levels;
+	for(int i=0;i<levels;++i) {
+		priorities->lanes[i].ring = calloc(queue->max_depth, sizeof(struct message_queue_slot));
+		if(!priorities->lanes[i].ring)
+			goto error_after_lanes;
+	}
+	queue->priorities = priorities;
+	return 0;
+
+error_after_lanes:
+	for(int i=0;i<levels;++i) {
+		free(priorities->lanes[i].ring);
+	}
+	free(priorities);
+	return -1;
+}
+
+int message_queue_enable_shards(struct message_queue *queue, int count) {
+	struct message_queue_shards *shards;
+	if(queue_shared(queue) || queue->priorities || queue->growth || queue->tracing || queue->shards || count < 1) {
+		errno = EINVAL;
+		return -1;
+	}
+	if(posix_memalign((void **)&shards, CACHE_LINE_SIZE, sizeof(*shards) + sizeof(struct message_queue_lane) * count))
+		return -1;
+	memset(shards, 0, sizeof(*shards) + sizeof(struct message_queue_lane) * count);
+	shards->count = count;
+	for(int i=0;i<count;++i) {
+		shards->shards[i].ring = calloc(queue->max_depth, sizeof(struct message_queue_slot));
+		if(!shards->shards[i].ring)
+			goto error_after_rings;
+	}
+	queue->shards = shards;
+	return 0;
+
+error_after_rings:
+	for(int i=0;i<count;++i) {
+		free(shards->shards[i].ring);
+	}
+	free(shards);
+	return -1;
+}
+
+int message_queue_enable_growth(struct message_queue *queue, size_t max_memory) {
+	struct message_queue_growth *growth;
+	struct message_queue_allocator *classes = queue_classes(queue);
+	if(queue_shared(queue) || queue->priorities || queue->growth || queue->tracing || queue->shards) {
+		errno = EINVAL;
+		return -1;
+	}
+	if(posix_memalign((void **)&growth, CACHE_LINE_SIZE, sizeof(*growth)))
+		return -1;
+	memset(growth, 0, sizeof(*growth));
+	pthread_mutex_init(&growth->lock, NULL);
+	growth->max_memory = max_memory;
+	growth->blocks = queue->allocator.max_depth;
+	growth->memory = segment_size(queue);
+	for(int i=0;i<queue->num_classes;++i) {
+		growth->blocks += classes[i].max_depth;
+		growth->memory += align_up(sizeof(struct message_queue_slot) * classes[i].max_depth) + (size_t)classes[i].message_size * classes[i].max_depth;
+	}
+	growth->ring.slots = queue_ring(queue);
+	growth->ring.max_depth = queue->max_depth;
+	growth->head = growth->tail = &growth->ring;
+	queue->growth = growth;
+	return 0;
+}
+
 void message_queue_destroy(struct message_queue *queue) {
-	sem_close(queue->queue.sem);
-	free(queue->queue_data);
-	sem_close(queue->allocator.sem);
-	free(queue->freelist);
-	free(queue->memory);
+	drop_magazines(queue, 0);
+	free(queue->stats);
+	if(queue->tracing) {
+		free(queue->tracing->stamps);
+		free(queue->tracing);
+	}
+	if(queue->selectors) {
+		pthread_mutex_destroy(&queue->selectors->lock);
+		free(queue->selectors);
+	}
+	if(queue->growth) {
+		struct message_queue_growth *growth = queue->growth;
+		for(int i=0;i<MESSAGE_QUEUE_MAX_SEGMENTS;++i) {
+			if(growth->active & (1ULL << i))
+				free(allocator_freelist(queue, &growth->segments[i]));
+		}
+		for(struct ring_segment *ring=growth->ring.next, *next;ring;ring=next) {
+			next = ring->next;
+			free(ring->slots);
+			free(ring);
+		}
+		pthread_mutex_destroy(&growth->lock);
+		free(growth);
+	}
+	if(queue->priorities) {
+		for(int i=0;i<queue->priorities->levels;++i) {
+			free(queue->priorities->lanes[i].ring);
+		}
+		free(queue->priorities);
+	}
+	if(queue->shards) {
+		for(int i=0;i<queue->shards->count;++i) {
+			free(queue->shards->shards[i].ring);
+		}
+		free(queue->shards);
+	}
+	if(queue->queue.eventfd >= 0)
+		close(queue->queue.eventfd);
+	if(queue->flags & MESSAGE_QUEUE_MAPPED) {
+		munmap(queue_memory(queue), queue->mapping_size);
+		free(queue_classes(queue));
+		return;
+	}
+	free(queue_ring(queue));
+	if(queue->num_classes) {
+		free(allocator_freelist(queue, queue_classes(queue)));
+		free(queue_classes(queue));
+	} else {
+		free(allocator_freelist(queue, &queue->allocator));
+	}
+	free(queue_memory(queue));
 }
@@ -34,33 +34,201 @@
 #define CACHE_LINE_SIZE 64
 #endif
 
-#include <semaphore.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * \brief Flag set on queues that live in memory shared between processes
+ */
+#define MESSAGE_QUEUE_SHARED 1
+
+/**
+ * \brief Largest per-thread magazine, in messages
+ */
+#ifndef MESSAGE_QUEUE_MAGAZINE_MAX
+#define MESSAGE_QUEUE_MAGAZINE_MAX 64
+#endif
+
+/**
+ * \brief Most priority levels a queue can have
+ */
+#define MESSAGE_QUEUE_MAX_PRIORITIES 32
+
+/**
+ * \brief Most segments a growable queue can add
+ */
+#define MESSAGE_QUEUE_MAX_SEGMENTS 64
+
+/**
+ * \brief Wait policies for message_queue_set_wait_policy
+ */
+#define MESSAGE_QUEUE_WAIT_PARK 0     /**< sleep as soon as there's nothing to do (the default) */
+#define MESSAGE_QUEUE_WAIT_SPIN 1     /**< spin and never sleep */
+#define MESSAGE_QUEUE_WAIT_BACKOFF 2  /**< spin, then yield, then sleep */
+#define MESSAGE_QUEUE_WAIT_ADAPTIVE 3 /**< like BACKOFF, with the spin count learned as the queue runs */
+
+/**
+ * \brief Ring slot
+ *
+ * Both the freelist and the queue itself are rings of these. data is the
+ * message's offset from the start of the queue's memory. seq holds the
+ * position (less the slot's index) that the slot is waiting for: a writer at
+ * position pos may fill the slot once seq reaches pos's lap, and a reader may
+ * take it once seq reaches lap + 1. Threads that have to wait for a slot park
+ * on seq with a futex.
+ */
+struct message_queue_slot {
+	unsigned int seq;
+	intptr_t data;
+};
+
+/**
+ * \brief How blocking calls wait, from message_queue_set_wait_policy
+ */
+struct message_queue_wait_policy {
+	int mode;    /**< one of the MESSAGE_QUEUE_WAIT_ constants */
+	int spins;   /**< most times to retry with a pause before yielding */
+	int yields;  /**< times to retry with sched_yield before sleeping */
+};
+
+/**
+ * \brief How long messages waited in a queue, from
+ *        message_queue_latency_snapshot
+ *
+ * Times are in nanoseconds, from just before a message went into the ring to
+ * just after a reader took it out, and are accurate to within about 12%.
+ */
+struct message_queue_latency {
+	uint64_t count;  /**< messages timed */
+	uint64_t p50;    /**< median wait */
+	uint64_t p90;    /**< 90th percentile wait */
+	uint64_t p99;    /**< 99th percentile wait */
+	uint64_t p999;   /**< 99.9th percentile wait */
+	uint64_t max;    /**< longest wait */
+};
+
+struct message_queue_stats_shard;
+struct message_queue_tracing;
+struct message_queue_priorities;
+struct message_queue_growth;
+struct message_queue_selectors;
+struct message_queue_shards;
+
+/**
+ * \brief Snapshot of a queue's statistics, from message_queue_get_stats
+ */
+struct message_queue_stats {
+	uint64_t enqueues;       /**< messages written */
+	uint64_t dequeues;       /**< messages read */
+	uint64_t failed_allocs;  /**< allocations that found no free memory */
+	uint64_t spins;          /**< iterations spent spinning on slot handoffs */
+	uint64_t parks;          /**< times a thread went to sleep in the kernel */
+	uint64_t wakes;          /**< wakeup calls made for sleeping threads */
+	int high_water;          /**< most messages ever waiting in the queue */
+	int depth;               /**< messages waiting in the queue right now */
+	int free_blocks;         /**< free messages in the largest size class */
+};
+
+/**
+ * \brief Allocator for one size class of messages
+ *
+ * memory is the offset of the class's first message from the start of the
+ * queue's memory, and freelist is the offset of its freelist from the queue
+ * structure. fresh_blocks counts messages at the end of the class that have
+ * never been handed out; they're counted in free_blocks but aren't on the
+ * freelist yet.
+ */
+struct message_queue_allocator {
+	unsigned int message_size;
+	unsigned int max_depth;
+	intptr_t memory;
+	intptr_t freelist;
+	unsigned int wakeup;
+	unsigned int blocked_readers;
+	unsigned int slot_waiters;
+	int free_blocks;
+	int fresh_blocks;
+	unsigned int allocpos __attribute__((aligned(CACHE_LINE_SIZE)));
+	unsigned int freepos __attribute__((aligned(CACHE_LINE_SIZE)));
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+/**
+ * \brief Size class description, for message_queue_init_classes
+ */
+struct message_queue_size_class {
+	int message_size;
+	int count;
+};
+
+/**
+ * \brief Flags for message_queue_options
+ */
+#define MESSAGE_QUEUE_NUMA_NODE  1 /**< bind queue memory to numa_node */
+#define MESSAGE_QUEUE_NUMA_LOCAL 2 /**< bind queue memory to the calling thread's node */
+#define MESSAGE_QUEUE_HUGEPAGES  4 /**< back queue memory with transparent huge pages */
+#define MESSAGE_QUEUE_HUGETLB    8 /**< back queue memory with explicit huge pages */
+#define MESSAGE_QUEUE_LAZY      16 /**< set up in constant time, committing pages on first use */
+
+/**
+ * \brief Memory placement options, for message_queue_init_options
+ */
+struct message_queue_options {
+	int flags;
+	int numa_node;
+};
 
 /**
  * \brief Message queue structure
  *
- * This structure is passed to all message_queue API calls
+ * This structure is passed to all message_queue API calls. memory, classes
+ * and queue_data are offsets from the structure itself rather than pointers,
+ * so a queue placed in shared memory works wherever each process maps it.
+ * That also means the structure must not be moved or copied once it has been
+ * initialized.
+ *
+ * allocator serves the largest messages. Queues set up with
+ * message_queue_init_classes have num_classes more allocators for smaller
+ * messages, smallest first, at classes.
  */
 struct message_queue {
 	unsigned int message_size;
 	unsigned int max_depth;
-	void *memory;
-	void **freelist;
-	void **queue_data;
-	struct {
-		sem_t *sem;
-		unsigned int blocked_readers;
-		int free_blocks;
-		unsigned int allocpos __attribute__((aligned(CACHE_LINE_SIZE)));
-		unsigned int freepos __attribute__((aligned(CACHE_LINE_SIZE)));
-	} allocator __attribute__((aligned(CACHE_LINE_SIZE)));
+	unsigned int flags;
+	unsigned int magic;
+	unsigned int magazine_size;
+	size_t mapping_size;
+	struct message_queue_wait_policy wait;
+	int wait_estimate;
+	struct message_queue_stats_shard *stats;
+	struct message_queue_tracing *tracing;
+	struct message_queue_priorities *priorities;
+	struct message_queue_growth *growth;
+	struct message_queue_selectors *selectors;
+	struct message_queue_shards *shards;
+	intptr_t memory;
+	intptr_t queue_data;
+	unsigned int num_classes;
+	intptr_t classes;
+	struct message_queue_allocator allocator;
 	struct {
-		sem_t *sem;
+		unsigned int wakeup;
 		unsigned int blocked_readers;
+		unsigned int slot_waiters;
 		int entries;
+		int eventfd;
 		unsigned int readpos __attribute__((aligned(CACHE_LINE_SIZE)));
 		unsigned int writepos __attribute__((aligned(CACHE_LINE_SIZE)));
 	} queue __attribute__((aligned(CACHE_LINE_SIZE)));
+	struct {
+		unsigned int requested;
+		unsigned int completed;
+		unsigned int leader;
+		unsigned int generation;
+	} sync __attribute__((aligned(CACHE_LINE_SIZE)));
 };
 
 /**
@@ -79,6 +247,194 @@ struct message_queue {
  */
 int message_queue_init(struct message_queue *queue, int message_size, int max_depth);
 
+/**
+ * \brief Initialize a message queue structure with several size classes
+ *
+ * Instead of padding every message to the largest size, the queue keeps a
+ * separate pool of messages for each size class. Use
+ * message_queue_message_alloc_sized to allocate from the smallest class that
+ * fits; message_queue_message_alloc and friends allocate from the largest.
+ * message_queue_message_free returns each message to its own class.
+ *
+ * The queue can hold as many messages as all of the classes put together.
+ *
+ * \param queue pointer to the message queue structure to initialize
+ * \param classes array of size classes, in increasing order of message_size.
+ *        Each class's count will be rounded to the next highest power of two.
+ * \param num_classes number of entries in classes
+ *
+ * \return 0 if successful, or nonzero if an error occured
+ */
+int message_queue_init_classes(struct message_queue *queue, const struct message_queue_size_class *classes, int num_classes);
+
+/**
+ * \brief Initialize a message queue structure with control over its memory
+ *
+ * Like message_queue_init_classes, but the messages, freelists and ring are
+ * placed in a single mapping as options asks. With MESSAGE_QUEUE_NUMA_NODE or
+ * MESSAGE_QUEUE_NUMA_LOCAL, the pages are bound to one NUMA node; for the
+ * consumer's node, call this from the consumer thread with
+ * MESSAGE_QUEUE_NUMA_LOCAL. MESSAGE_QUEUE_HUGEPAGES asks for 2MB transparent
+ * huge pages, and MESSAGE_QUEUE_HUGETLB takes explicit ones from the system's
+ * huge page pool, failing if there aren't enough.
+ *
+ * MESSAGE_QUEUE_LAZY skips filling in the freelists and the ring, so
+ * initialization takes the same time however deep the queue is. Messages are
+ * handed out in address order until each class has used all of its memory,
+ * and only then recycled through the freelist, so pages are only committed
+ * as the queue reaches new peaks.
+ *
+ * \param queue pointer to the message queue structure to initialize
+ * \param classes array of size classes, as for message_queue_init_classes
+ * \param num_classes number of entries in classes
+ * \param options memory placement options, or NULL for the default
+ *
+ * \return 0 if successful, or nonzero if an error occured
+ */
+int message_queue_init_options(struct message_queue *queue, const struct message_queue_size_class *classes, int num_classes, const struct message_queue_options *options);
+
+/**
+ * \brief Create a message queue in shared memory
+ *
+ * This creates a POSIX shared memory object holding the whole queue: its
+ * counters, freelist, ring and message memory. Other processes can then
+ * attach to it with message_queue_attach_shared, and messages allocated in
+ * one process can be read in place by another. Blocked threads wait on
+ * process-shared futexes.
+ *
+ * Messages are shared as-is, so they must not contain pointers unless every
+ * process maps what they point to at the same address.
+ *
+ * \param name name of the shared memory object, as for shm_open. It must not
+ *        already exist.
+ * \param message_size size in bytes of the largest message that will be sent
+ *        on this queue
+ * \param max_depth the maximum number of message to allow in the queue at
+ *        once. This will be rounded to the next highest power of two.
+ * \return pointer to the queue, or NULL if an error occured
+ */
+struct message_queue *message_queue_create_shared(const char *name, int message_size, int max_depth);
+
+/**
+ * \brief Attach to a message queue in shared memory
+ *
+ * \param name name of a shared memory object created with
+ *        message_queue_create_shared
+ * \return pointer to the queue, or NULL if an error occured
+ */
+struct message_queue *message_queue_attach_shared(const char *name);
+
+/**
+ * \brief Create a message queue in a file
+ *
+ * Like message_queue_create_shared, but the queue is placed in an open file
+ * descriptor, which is resized to fit. The descriptor can be closed
+ * afterward. This is useful with memfd_create, passing the descriptor to
+ * other processes over a UNIX socket.
+ *
+ * \param fd file descriptor, open for reading and writing
+ * \param message_size size in bytes of the largest message that will be sent
+ *        on this queue
+ * \param max_depth the maximum number of message to allow in the queue at
+ *        once. This will be rounded to the next highest power of two.
+ * \return pointer to the queue, or NULL if an error occured
+ */
+struct message_queue *message_queue_create_fd(int fd, int message_size, int max_depth);
+
+/**
+ * \brief Attach to a message queue in a file
+ *
+ * \param fd file descriptor referring to a queue created with
+ *        message_queue_create_fd, open for reading and writing
+ * \return pointer to the queue, or NULL if an error occured
+ */
+struct message_queue *message_queue_attach_fd(int fd);
+
+/**
+ * \brief Detach from a message queue in shared memory
+ *
+ * This returns any messages in this process's magazines to the queue and
+ * unmaps it from the calling process. The queue itself lives on
+ * until its shared memory object is removed with shm_unlink and every
+ * process has detached.
+ *
+ * \param queue pointer to the queue to detach from
+ */
+void message_queue_detach_shared(struct message_queue *queue);
+
+/**
+ * \brief Open a message queue kept in a file, recovering its messages
+ *
+ * If the file is empty or doesn't exist, a new queue is created in it, as
+ * with message_queue_create_fd. Otherwise the queue already in it is
+ * opened, and every message that was written but never read is put back in
+ * the queue, in the order it was written. Messages that were allocated but
+ * never written, or read but never freed, are returned to the freelist.
+ *
+ * After the process crashes, every message it wrote is recovered (and one
+ * it was in the middle of reading may be read again). To also survive a
+ * crash of the whole machine, call message_queue_sync after writing;
+ * messages written since the last sync may be lost or damaged.
+ *
+ * Only one process may have the file open at a time. Close it with
+ * message_queue_detach_shared.
+ *
+ * \param path path of the file
+ * \param message_size size in bytes of the largest message that will be sent
+ *        on this queue. Must match the size the file was created with.
+ * \param max_depth the maximum number of message to allow in the queue at
+ *        once. Must match the depth the file was created with.
+ * \return pointer to the queue, or NULL if an error occured
+ */
+struct message_queue *message_queue_open_journal(const char *path, int message_size, int max_depth);
+
+/**
+ * \brief Flush a queue in a file to disk
+ *
+ * Returns once every message written before the call is on disk. Calls from
+ * several threads at once are combined, so that a single flush covers all
+ * of them; writing a batch of messages and then syncing costs one flush for
+ * the whole batch.
+ *
+ * \param queue pointer to a queue created with message_queue_open_journal or
+ *        message_queue_create_fd
+ * \return 0 if successful, or nonzero if an error occured
+ */
+int message_queue_sync(struct message_queue *queue);
+
+/**
+ * \brief Give each thread a magazine of free messages for this queue
+ *
+ * With magazines enabled, message_queue_message_alloc and
+ * message_queue_message_free work out of a small per-thread stack of free
+ * messages, only going to the queue's shared freelist (in bulk) when the
+ * stack runs empty or fills up. Most allocations and frees then touch no
+ * shared memory at all.
+ *
+ * Messages sitting in one thread's magazine aren't available to other
+ * threads, so a queue with magazines can appear to run out of memory
+ * sooner. A thread's magazine is flushed when it blocks in
+ * message_queue_read, when it exits, or by calling
+ * message_queue_magazine_flush; threads that free messages and then block
+ * somewhere else should flush first.
+ *
+ * This should be called before the queue is used. Only messages of the
+ * largest size class are cached.
+ *
+ * \param queue pointer to the message queue
+ * \param size the number of messages each thread may cache, up to
+ *        MESSAGE_QUEUE_MAGAZINE_MAX and half of the queue's depth, or 0 to
+ *        disable magazines
+ */
+void message_queue_enable_magazines(struct message_queue *queue, int size);
+
+/**
+ * \brief Return the calling thread's cached messages to the queue
+ *
+ * \param queue pointer to the message queue
+ */
+void message_queue_magazine_flush(struct message_queue *queue);
+
 /**
  * \brief Allocate a new message
  *
@@ -106,6 +462,36 @@ void *message_queue_message_alloc(struct message_queue *queue);
  */
 void *message_queue_message_alloc_blocking(struct message_queue *queue);
 
+/**
+ * \brief Allocate a new message of a given size
+ *
+ * This allocates a message from the smallest size class that can hold size
+ * bytes, moving on to larger classes if that one is out of memory. It never
+ * blocks.
+ *
+ * \param queue pointer to the message queue to which the message will be
+ *        written
+ * \param size size in bytes of the message
+ * \return pointer to the allocated message, or NULL if no class that can
+ *         hold size bytes has memory available
+ */
+void *message_queue_message_alloc_sized(struct message_queue *queue, int size);
+
+/**
+ * \brief Allocate several messages at once
+ *
+ * This allocates up to count messages with a single update of the shared
+ * allocator counters. It never blocks.
+ *
+ * \param queue pointer to the message queue to which the messages will be
+ *        written
+ * \param messages array that receives the allocated messages
+ * \param count the maximum number of messages to allocate
+ * \return the number of messages allocated, which may be less than count (or
+ *         zero) if not enough memory is available
+ */
+int message_queue_message_alloc_batch(struct message_queue *queue, void **messages, int count);
+
 /**
  * \brief Free a message
  *
@@ -119,6 +505,19 @@ void *message_queue_message_alloc_blocking(struct message_queue *queue);
  */
 void message_queue_message_free(struct message_queue *queue, void *message);
 
+/**
+ * \brief Free several messages at once
+ *
+ * Equivalent to calling message_queue_message_free on each message, but
+ * blocked allocators are woken with a single call.
+ *
+ * \param queue pointer to the message queue from which the messages were
+ *        allocated
+ * \param messages array of messages to be freed
+ * \param count the number of messages in the array
+ */
+void message_queue_message_free_batch(struct message_queue *queue, void **messages, int count);
+
 /**
  * \brief Write a message to the queue
  *
@@ -130,6 +529,46 @@ void message_queue_message_free(struct message_queue *queue, void *message);
  */
 void message_queue_write(struct message_queue *queue, void *message);
 
+/**
+ * \brief Write several messages to the queue at once
+ *
+ * The messages are written in order into consecutive positions in the queue,
+ * claimed with a single atomic operation. Blocked readers are woken with a
+ * single call.
+ *
+ * \param queue pointer to the queue to which to write
+ * \param messages array of messages to write to the queue
+ * \param count the number of messages in the array
+ */
+void message_queue_write_batch(struct message_queue *queue, void **messages, int count);
+
+/**
+ * \brief Give a queue several priority levels
+ *
+ * Each level has its own FIFO ring; all of them share the queue's allocator.
+ * Readers always take from the highest non-empty level, found from a bitmap
+ * rather than by scanning, so an urgent message doesn't wait behind a backlog
+ * of less urgent ones. message_queue_write and message_queue_write_batch
+ * write at level 0. Must be called before any messages are written. Queues in
+ * shared memory or that can grow can't have priority levels.
+ *
+ * \param queue pointer to the queue
+ * \param levels the number of levels, at most MESSAGE_QUEUE_MAX_PRIORITIES
+ * \return 0 if successful, or nonzero if an error occured
+ */
+int message_queue_enable_priorities(struct message_queue *queue, int levels);
+
+/**
+ * \brief Write a message to the queue at a priority level
+ *
+ * \param queue pointer to the queue to which to write
+ * \param message pointer to a message obtained from
+ *        message_queue_message_alloc
+ * \param priority the level, from 0 (lowest) to one less than the number of
+ *        levels passed to message_queue_enable_priorities
+ */
+void message_queue_write_prio(struct message_queue *queue, void *message, int priority);
+
 /**
  * \brief Read a message from the queue if one is available
  *
@@ -150,13 +589,202 @@ void *message_queue_tryread(struct message_queue *queue);
  */
 void *message_queue_read(struct message_queue *queue);
 
+/**
+ * \brief Read several messages from the queue if any are available
+ *
+ * \param queue pointer to the queue from which to read
+ * \param messages array that receives the messages read
+ * \param max the maximum number of messages to read
+ * \return the number of messages read, or zero if no messages are available
+ */
+int message_queue_tryread_batch(struct message_queue *queue, void **messages, int max);
+
+/**
+ * \brief Read several messages from the queue
+ *
+ * This blocks until at least one message is available, then reads as many
+ * as are available, up to max. If max is less than 1, it returns 0 without
+ * blocking.
+ *
+ * \param queue pointer to the queue from which to read
+ * \param messages array that receives the messages read
+ * \param max the maximum number of messages to read
+ * \return the number of messages read
+ */
+int message_queue_read_batch(struct message_queue *queue, void **messages, int max);
+
+/**
+ * \brief Wait until any of several queues has a message
+ *
+ * The thread parks once, however many queues it's waiting on, and is woken
+ * by a write to any of them. Since other readers may get there first, the
+ * returned queue can be empty again by the time it's read; use
+ * message_queue_tryread and select again if it comes back NULL. When several
+ * queues have messages, the one earliest in queues is returned. Queues in
+ * shared memory can't be waited on this way.
+ *
+ * \param queues array of queues to wait on
+ * \param count the number of queues in the array
+ * \param timeout the longest time to wait, in milliseconds, or -1 to wait
+ *        forever
+ * \return the index in queues of a queue that has a message, or -1 if the
+ *         timeout ran out (errno is ETIMEDOUT) or an error occured
+ */
+int message_queue_select(struct message_queue **queues, int count, int timeout);
+
+/**
+ * \brief Get a file descriptor that becomes readable when messages arrive
+ *
+ * This returns an eventfd that writers signal whenever the queue goes from
+ * empty to non-empty, so a thread can wait for messages with select, poll or
+ * epoll alongside its other file descriptors. Once it's readable, read it to
+ * reset it and then call message_queue_tryread until the queue is empty;
+ * there won't be another signal until the queue has been drained.
+ *
+ * The descriptor is created on first use and belongs to the queue. This
+ * isn't available for queues in shared memory.
+ *
+ * \param queue pointer to the queue
+ * \return the file descriptor, or -1 if an error occured
+ */
+int message_queue_get_fd(struct message_queue *queue);
+
+/**
+ * \brief Let a queue grow when it runs out of messages
+ *
+ * When every message is in use, allocation adds a segment of as many
+ * messages as the queue's largest size class started with, instead of
+ * failing or blocking, and grows the queue's ring to match if needed.
+ * Segments are given back once all of their messages have been freed and the
+ * original pool is at least half free again. Allocating and freeing stay
+ * lock-free except when a segment is added or retired.
+ *
+ * Messages still come out of the queue in order across growth. The ring
+ * doesn't shrink again: it stays as deep as the queue has ever been, at 16
+ * bytes per message.
+ *
+ * Must be called before the queue is used. Queues in shared memory or with
+ * priority levels can't grow.
+ *
+ * \param queue pointer to the queue
+ * \param max_memory most bytes of messages and freelists the queue may hold,
+ *        counting those it was initialized with. At most
+ *        MESSAGE_QUEUE_MAX_SEGMENTS segments are ever added.
+ * \return 0 if successful, or nonzero if an error occured
+ */
+int message_queue_enable_growth(struct message_queue *queue, size_t max_memory);
+
+/**
+ * \brief Split a queue into shards, so threads don't contend on one ring
+ *
+ * Normally every read and write on a queue updates the same few counters,
+ * whose cache lines bounce between all the CPUs using it. A sharded queue
+ * gives each thread a home shard, with its own ring and counters: writes
+ * always go to the writer's home shard, and reads take from the reader's
+ * home shard first and then sweep the others. Threads get home shards in
+ * turn the first time they use a sharded queue, so with at least as many
+ * shards as threads, no two threads share one.
+ *
+ * Messages from any one thread are still read in the order they were
+ * written, but there's no order between messages from different threads.
+ * Each shard's ring holds the whole queue's depth, so sharding costs
+ * max_depth ring slots per shard. The freelist is still shared; enable
+ * magazines as well to keep allocation off it.
+ *
+ * This must be called before the queue is used, and can't be combined with
+ * priorities, growth, or queues in shared memory.
+ *
+ * \param queue pointer to the queue
+ * \param shards how many shards to split the queue into
+ * \return 0 if successful, or nonzero if an error occured
+ */
+int message_queue_enable_shards(struct message_queue *queue, int shards);
+
+/**
+ * \brief Choose how blocking calls on a queue wait
+ *
+ * Applies to message_queue_read, message_queue_read_batch and
+ * message_queue_message_alloc_blocking, and to the short waits for a slot
+ * another thread is still filling. By default those sleep in the kernel
+ * straight away, which suits consumers that only wake up now and then. With
+ * MESSAGE_QUEUE_WAIT_SPIN they never sleep, which gives the lowest latency
+ * at the cost of a CPU per waiting thread. MESSAGE_QUEUE_WAIT_BACKOFF tries
+ * spins times with a pause, then yields times with sched_yield, before
+ * sleeping. MESSAGE_QUEUE_WAIT_ADAPTIVE does the same but keeps an average of
+ * how long messages take to show up, and only spins about that long, up to
+ * spins, so queues whose messages arrive far apart soon stop spinning.
+ *
+ * \param queue pointer to the queue
+ * \param policy the wait policy to use
+ * \return 0 if successful, or nonzero if the policy is invalid
+ */
+int message_queue_set_wait_policy(struct message_queue *queue, const struct message_queue_wait_policy *policy);
+
+/**
+ * \brief Start keeping statistics for a queue
+ *
+ * Counters are kept in per-thread shards, each on its own cache line, so the
+ * cost while enabled is a few uncontended increments per operation. Without
+ * this, the queue keeps no counters at all. Queues in shared memory can't
+ * keep statistics.
+ *
+ * \param queue pointer to the queue
+ * \return 0 if successful, or nonzero if an error occured
+ */
+int message_queue_enable_stats(struct message_queue *queue);
+
+/**
+ * \brief Start timing how long messages wait in a queue
+ *
+ * Every message written from then on is stamped with the time as it goes
+ * into the ring, and whoever reads it adds the time it waited to a
+ * histogram. Messages already in flight when tracing is enabled aren't
+ * stamped, and are skipped. Histograms are kept in per-thread shards like
+ * statistics, so the cost is a clock read on each side and one uncontended
+ * increment. Queues with priorities, growth or shards, and queues in shared
+ * memory, can't be traced.
+ *
+ * \param queue pointer to the queue
+ * \return 0 if successful, or nonzero if an error occured
+ */
+int message_queue_enable_tracing(struct message_queue *queue);
+
+/**
+ * \brief Summarize how long messages have waited in a queue
+ *
+ * Covers every message read since tracing was enabled. Like
+ * message_queue_get_stats, the snapshot isn't atomic. Everything is zero if
+ * tracing isn't enabled.
+ *
+ * \param queue pointer to the queue
+ * \param latency structure to fill in
+ */
+void message_queue_latency_snapshot(struct message_queue *queue, struct message_queue_latency *latency);
+
+/**
+ * \brief Take a snapshot of a queue's statistics
+ *
+ * The snapshot isn't atomic: counters updated while it's being taken may or
+ * may not be included. depth and free_blocks are filled in even if
+ * statistics aren't enabled.
+ *
+ * \param queue pointer to the queue
+ * \param stats structure to fill in
+ */
+void message_queue_get_stats(struct message_queue *queue, struct message_queue_stats *stats);
+
 /**
  * \brief Destroy a message queue structure
  *
- * This frees any resources associated with the message queue.
+ * This frees any resources associated with the message queue. Queues in
+ * shared memory are released with message_queue_detach_shared instead.
  *
  * \param queue pointer to the message queue to destroy
  */
 void message_queue_destroy(struct message_queue *queue);
 
+#ifdef __cplusplus
+}
+#endif
+
 #endif
@@ -0,0 +1,595 @@
+/*
+ * Copyright (c) 2012 Jeremy Pepper
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  * Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of message_queue nor the names of its contributors may
+ *    be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef MESSAGE_QUEUE_HPP
+#define MESSAGE_QUEUE_HPP
+
+#include "message_queue.h"
+#include <climits>
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <sched.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+#if defined(__cpp_impl_coroutine) && __cpp_impl_coroutine >= 201902L
+#include <coroutine>
+#include <tuple>
+#define MQ_HAVE_COROUTINES 1
+#endif
+
+/**
+ * \brief Typed C++ message queues
+ *
+ * mq::message_queue<T, Depth> works like struct message_queue, but its depth
+ * and message type are fixed at compile time: the ring index mask and message
+ * slot size are constants, and all of the queue's memory lives inside the
+ * object, so each instantiation gets its own straight-line index math. It
+ * needs C++11 and nothing but this header; with C++20, reads and allocations
+ * can also be awaited from coroutines.
+ */
+namespace mq {
+
+namespace detail {
+
+constexpr unsigned int round_to_pow2(unsigned int x, unsigned int pow2 = 1) {
+	return pow2 >= x ? pow2 : round_to_pow2(x, pow2 << 1);
+}
+
+inline void cpu_relax() noexcept {
+#if defined(__i386__) || defined(__x86_64__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__)
+	__asm__ __volatile__("yield" ::: "memory");
+#else
+	__sync_synchronize();
+#endif
+}
+
+// A queue lives in one process, so private futexes are enough
+#ifdef __linux__
+inline void futex_wait(unsigned int *addr, unsigned int val) noexcept {
+	syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, nullptr, nullptr, 0);
+}
+
+inline void futex_wake(unsigned int *addr, int count) noexcept {
+	syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, count, nullptr, nullptr, 0);
+}
+#else
+inline void futex_wait(unsigned int *addr, unsigned int val) noexcept {
+	if(__atomic_load_n(addr, __ATOMIC_ACQUIRE) == val)
+		sched_yield();
+}
+
+inline void futex_wake(unsigned int *, int) noexcept {
+}
+#endif
+
+}
+
+#ifdef MQ_HAVE_COROUTINES
+/**
+ * \brief Executor that resumes coroutines right away, on the thread that
+ *        made their message or slot available
+ */
+struct inline_executor {
+	void operator()(std::coroutine_handle<> handle) const {
+		handle.resume();
+	}
+};
+#endif
+
+/**
+ * \brief Multiple-producer/multiple-consumer queue of T
+ *
+ * Messages are constructed in place in the queue's own storage and handed
+ * around as message handles, which destroy the T and return its slot when
+ * they go out of scope. Payloads only ever move, so move-only types work.
+ *
+ * The queue holds all Depth messages inline; give big queues static or heap
+ * storage (before C++17, new won't honour its cache line alignment, which
+ * costs some false sharing but is otherwise harmless). It must not be moved
+ * or copied, and every handle must be gone before it's destroyed.
+ *
+ * \tparam T the message type
+ * \tparam Depth the maximum number of messages in the queue at once, rounded
+ *         up to a power of two
+ */
+template<typename T, unsigned int Depth>
+class message_queue {
+public:
+	static_assert(Depth > 0 && Depth <= (1u << 31), "Depth must be between 1 and 2^31");
+
+	static constexpr unsigned int depth = detail::round_to_pow2(Depth);
+	static constexpr unsigned int mask = depth - 1;
+
+private:
+	typedef typename std::aligned_storage<sizeof(T), alignof(T)>::type storage;
+
+	struct slot {
+		unsigned int seq;
+		T *data;
+	};
+
+	// A coroutine waiting on one side of the queue. Whoever publishes to
+	// that side claims a value for it and calls wake.
+	struct waiter {
+		waiter *next;
+		T *value;
+		void (*wake)(waiter *);
+	};
+
+public:
+	static constexpr std::size_t slot_size = sizeof(storage);
+
+	/**
+	 * \brief Owning handle to a message
+	 *
+	 * Destroying or resetting a handle destroys its T and gives the slot
+	 * back to the queue. Writing a handle to the queue hands the T over to
+	 * whoever reads it.
+	 */
+	class message {
+	public:
+		message() noexcept : queue_(nullptr), value_(nullptr) {}
+		message(message &&other) noexcept : queue_(other.queue_), value_(other.value_) {
+			other.value_ = nullptr;
+		}
+		message &operator=(message &&other) noexcept {
+			if(this != &other) {
+				reset();
+				queue_ = other.queue_;
+				value_ = other.value_;
+				other.value_ = nullptr;
+			}
+			return *this;
+		}
+		message(const message &) = delete;
+		message &operator=(const message &) = delete;
+		~message() {
+			reset();
+		}
+
+		T &operator*() const noexcept { return *value_; }
+		T *operator->() const noexcept { return value_; }
+		T *get() const noexcept { return value_; }
+		explicit operator bool() const noexcept { return value_ != nullptr; }
+
+		void reset() noexcept {
+			if(value_) {
+				value_->~T();
+				queue_->release(value_);
+				value_ = nullptr;
+			}
+		}
+
+	private:
+		friend class message_queue;
+		message(message_queue *queue, T *value) noexcept : queue_(queue), value_(value) {}
+
+		message_queue *queue_;
+		T *value_;
+	};
+
+	message_queue() noexcept {
+		for(unsigned int i=0;i<depth;++i) {
+			freelist_[i].seq = 1;
+			freelist_[i].data = reinterpret_cast<T *>(&messages_[i]);
+			ring_[i].seq = 0;
+			ring_[i].data = nullptr;
+		}
+		allocator_.pos = 0;
+		allocator_.count = depth;
+		allocator_.slot_waiters = 0;
+		allocator_.wakeup = 0;
+		allocator_.blocked = 0;
+		allocator_.awaiting = 0;
+		allocator_.lock = 0;
+		allocator_.head = allocator_.tail = nullptr;
+		freepos_ = depth;
+		queue_.pos = 0;
+		queue_.count = 0;
+		queue_.slot_waiters = 0;
+		queue_.wakeup = 0;
+		queue_.blocked = 0;
+		queue_.awaiting = 0;
+		queue_.lock = 0;
+		queue_.head = queue_.tail = nullptr;
+		writepos_ = 0;
+	}
+
+	message_queue(const message_queue &) = delete;
+	message_queue &operator=(const message_queue &) = delete;
+
+	~message_queue() {
+		while(tryread());
+	}
+
+	/**
+	 * \brief Construct a message in place, if there's room
+	 *
+	 * \return a handle to the new message, or an empty handle if the queue's
+	 *         messages are all in use
+	 */
+	template<typename... Args>
+	message alloc(Args &&...args) {
+		T *value = claim(allocator_, freelist_);
+		if(!value)
+			return message();
+		return construct(value, std::forward<Args>(args)...);
+	}
+
+	/**
+	 * \brief Construct a message in place, waiting for room if need be
+	 */
+	template<typename... Args>
+	message alloc_blocking(Args &&...args) {
+		return construct(claim_blocking(allocator_, freelist_), std::forward<Args>(args)...);
+	}
+
+	/**
+	 * \brief Write a message to the queue
+	 *
+	 * \param value a handle from this queue's alloc; it's left empty
+	 */
+	void write(message &&value) {
+		T *data = value.value_;
+		value.value_ = nullptr;
+		put(ring_, __sync_fetch_and_add(&writepos_, 1), data, &queue_.slot_waiters);
+		publish(queue_, ring_);
+	}
+
+	/**
+	 * \brief Construct a message in place and write it, if there's room
+	 *
+	 * \return true if the message was written
+	 */
+	template<typename... Args>
+	bool emplace(Args &&...args) {
+		message value = alloc(std::forward<Args>(args)...);
+		if(!value)
+			return false;
+		write(std::move(value));
+		return true;
+	}
+
+	/**
+	 * \brief Read a message from the queue if one is available
+	 *
+	 * \return a handle to the message, or an empty handle if none is waiting
+	 */
+	message tryread() {
+		T *value = claim(queue_, ring_);
+		return value ? message(this, value) : message();
+	}
+
+	/**
+	 * \brief Read a message from the queue, waiting for one if need be
+	 */
+	message read() {
+		return message(this, claim_blocking(queue_, ring_));
+	}
+
+#ifdef MQ_HAVE_COROUTINES
+	template<typename Executor>
+	class read_awaiter;
+	template<typename Executor, typename... Args>
+	class alloc_awaiter;
+
+	/**
+	 * \brief Read a message from a coroutine, suspending it until one is
+	 *        available
+	 *
+	 * co_await gives a message handle. A coroutine that has to wait is
+	 * queued, with no thread blocked on its behalf, and the writer that
+	 * hands it a message passes it to executor, which must be callable with
+	 * a std::coroutine_handle<> and should resume it, there or elsewhere.
+	 * The executor must outlive the wait, and a waiting coroutine must not
+	 * be destroyed.
+	 */
+	template<typename Executor>
+	read_awaiter<Executor> async_read(Executor &executor) noexcept {
+		return read_awaiter<Executor>(this, &executor);
+	}
+
+	/**
+	 * \brief async_read that resumes the coroutine on the writer's thread
+	 */
+	read_awaiter<inline_executor> async_read() noexcept {
+		static inline_executor executor;
+		return async_read(executor);
+	}
+
+	/**
+	 * \brief Construct a message in place from a coroutine, suspending it
+	 *        until there's room
+	 *
+	 * Like async_read, but waits on the freelist; whoever frees a slot
+	 * hands it over. The arguments are copied or moved into the awaiter, and
+	 * the message is constructed when the coroutine resumes.
+	 */
+	template<typename Executor, typename... Args>
+	alloc_awaiter<Executor, Args...> async_alloc_on(Executor &executor, Args &&...args) {
+		return alloc_awaiter<Executor, Args...>(this, &executor, std::forward<Args>(args)...);
+	}
+
+	/**
+	 * \brief async_alloc_on that resumes the coroutine on the freeing thread
+	 */
+	template<typename... Args>
+	alloc_awaiter<inline_executor, Args...> async_alloc(Args &&...args) {
+		static inline_executor executor;
+		return async_alloc_on(executor, std::forward<Args>(args)...);
+	}
+
+	template<typename Executor>
+	class read_awaiter : waiter {
+	public:
+		bool await_ready() noexcept {
+			this->value = claim(queue_->queue_, queue_->ring_);
+			return this->value != nullptr;
+		}
+		bool await_suspend(std::coroutine_handle<> handle) noexcept {
+			handle_ = handle;
+			return queue_->suspend(queue_->queue_, queue_->ring_, this);
+		}
+		message await_resume() noexcept {
+			return message(queue_, this->value);
+		}
+
+	private:
+		friend class message_queue;
+		read_awaiter(message_queue *queue, Executor *executor) noexcept : queue_(queue), executor_(executor) {
+			this->wake = &wake_awaiter;
+		}
+		static void wake_awaiter(waiter *w) {
+			read_awaiter *self = static_cast<read_awaiter *>(w);
+			(*self->executor_)(self->handle_);
+		}
+
+		message_queue *queue_;
+		Executor *executor_;
+		std::coroutine_handle<> handle_;
+	};
+
+	template<typename Executor, typename... Args>
+	class alloc_awaiter : waiter {
+	public:
+		bool await_ready() noexcept {
+			this->value = claim(queue_->allocator_, queue_->freelist_);
+			return this->value != nullptr;
+		}
+		bool await_suspend(std::coroutine_handle<> handle) noexcept {
+			handle_ = handle;
+			return queue_->suspend(queue_->allocator_, queue_->freelist_, this);
+		}
+		message await_resume() {
+			return std::apply([this](auto &&...args) {
+				return queue_->construct(this->value, std::forward<decltype(args)>(args)...);
+			}, std::move(args_));
+		}
+
+	private:
+		friend class message_queue;
+		template<typename... A>
+		alloc_awaiter(message_queue *queue, Executor *executor, A &&...args) : queue_(queue), executor_(executor), args_(std::forward<A>(args)...) {
+			this->wake = &wake_awaiter;
+		}
+		static void wake_awaiter(waiter *w) {
+			alloc_awaiter *self = static_cast<alloc_awaiter *>(w);
+			(*self->executor_)(self->handle_);
+		}
+
+		message_queue *queue_;
+		Executor *executor_;
+		std::coroutine_handle<> handle_;
+		std::tuple<std::decay_t<Args>...> args_;
+	};
+#endif
+
+private:
+
+	// One side of a ring: where to take from next, how many can be taken,
+	// and who's waiting
+	struct alignas(CACHE_LINE_SIZE) side {
+		unsigned int pos;
+		int count;
+		unsigned int slot_waiters;
+		unsigned int wakeup;
+		unsigned int blocked;
+		unsigned int awaiting;
+		int lock;
+		waiter *head;
+		waiter *tail;
+	};
+
+	template<typename... Args>
+	message construct(T *value, Args &&...args) {
+		try {
+			new(value) T(std::forward<Args>(args)...);
+		} catch(...) {
+			release(value);
+			throw;
+		}
+		return message(this, value);
+	}
+
+	void release(T *value) noexcept {
+		put(freelist_, __sync_fetch_and_add(&freepos_, 1), value, &allocator_.slot_waiters);
+		publish(allocator_, freelist_);
+	}
+
+	static void slot_wait(slot *s, unsigned int seq, unsigned int *waiters) noexcept {
+		unsigned int cur;
+		for(int i=0;i<128;++i) {
+			if(__atomic_load_n(&s->seq, __ATOMIC_ACQUIRE) == seq)
+				return;
+			detail::cpu_relax();
+		}
+		__sync_fetch_and_add(waiters, 1);
+		while((cur = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE)) != seq) {
+			detail::futex_wait(&s->seq, cur);
+		}
+		__sync_fetch_and_add(waiters, -1);
+	}
+
+	static void slot_publish(slot *s, unsigned int seq, unsigned int *waiters) noexcept {
+		__atomic_store_n(&s->seq, seq, __ATOMIC_SEQ_CST);
+		if(__atomic_load_n(waiters, __ATOMIC_SEQ_CST))
+			detail::futex_wake(&s->seq, INT_MAX);
+	}
+
+	static void put(slot *ring, unsigned int pos, T *value, unsigned int *waiters) noexcept {
+		slot *s = &ring[pos & mask];
+		unsigned int lap = pos & ~mask;
+		slot_wait(s, lap, waiters);
+		s->data = value;
+		slot_publish(s, lap + 1, waiters);
+	}
+
+	static T *take(slot *ring, unsigned int pos, unsigned int *waiters) noexcept {
+		slot *s = &ring[pos & mask];
+		unsigned int lap = pos & ~mask;
+		slot_wait(s, lap + 1, waiters);
+		T *value = s->data;
+		slot_publish(s, lap + depth, waiters);
+		return value;
+	}
+
+	static void publish(side &to, slot *ring) noexcept {
+		__sync_fetch_and_add(&to.count, 1);
+		if(__atomic_load_n(&to.blocked, __ATOMIC_SEQ_CST)) {
+			__sync_fetch_and_add(&to.wakeup, 1);
+			detail::futex_wake(&to.wakeup, 1);
+		}
+		if(__atomic_load_n(&to.awaiting, __ATOMIC_SEQ_CST))
+			hand_off(to, ring);
+	}
+
+	static void lock(side &s) noexcept {
+		while(__sync_lock_test_and_set(&s.lock, 1)) {
+			detail::cpu_relax();
+		}
+	}
+
+	static void unlock(side &s) noexcept {
+		__sync_lock_release(&s.lock);
+	}
+
+	// Claims values for as many waiting coroutines as it can, then wakes
+	// them outside the lock, since they may well resume right here
+	static void hand_off(side &from, slot *ring) noexcept {
+		waiter *ready = nullptr, **last = &ready;
+		lock(from);
+		while(from.head) {
+			T *value = claim(from, ring);
+			if(!value)
+				break;
+			waiter *w = from.head;
+			from.head = w->next;
+			if(!from.head)
+				from.tail = nullptr;
+			w->value = value;
+			w->next = nullptr;
+			*last = w;
+			last = &w->next;
+			__sync_fetch_and_add(&from.awaiting, -1);
+		}
+		unlock(from);
+		while(ready) {
+			waiter *w = ready;
+			ready = w->next;
+			w->wake(w);
+		}
+	}
+
+	// Queues a coroutine to be woken, unless a value turns up first, in
+	// which case it returns false and the coroutine carries on with it.
+	// Registering in awaiting before the last claim means a publisher either
+	// sees the waiter or leaves a value for that claim.
+	static bool suspend(side &from, slot *ring, waiter *w) noexcept {
+		lock(from);
+		__sync_fetch_and_add(&from.awaiting, 1);
+		w->value = claim(from, ring);
+		if(w->value) {
+			__sync_fetch_and_add(&from.awaiting, -1);
+			unlock(from);
+			return false;
+		}
+		w->next = nullptr;
+		if(from.tail)
+			from.tail->next = w;
+		else
+			from.head = w;
+		from.tail = w;
+		unlock(from);
+		return true;
+	}
+
+	static T *claim(side &from, slot *ring) noexcept {
+		if(__sync_fetch_and_add(&from.count, -1) > 0)
+			return take(ring, __sync_fetch_and_add(&from.pos, 1), &from.slot_waiters);
+		__sync_fetch_and_add(&from.count, 1);
+		return nullptr;
+	}
+
+	static T *claim_blocking(side &from, slot *ring) noexcept {
+		T *value = claim(from, ring);
+		while(!value) {
+			unsigned int wakeup = __atomic_load_n(&from.wakeup, __ATOMIC_ACQUIRE);
+			__sync_fetch_and_add(&from.blocked, 1);
+			value = claim(from, ring);
+			if(!value)
+				detail::futex_wait(&from.wakeup, wakeup);
+			__sync_fetch_and_add(&from.blocked, -1);
+		}
+		return value;
+	}
+
+	storage messages_[depth];
+	slot freelist_[depth];
+	slot ring_[depth];
+	side allocator_;
+	side queue_;
+	alignas(CACHE_LINE_SIZE) unsigned int freepos_;
+	alignas(CACHE_LINE_SIZE) unsigned int writepos_;
+};
+
+template<typename T, unsigned int Depth> constexpr unsigned int message_queue<T, Depth>::depth;
+template<typename T, unsigned int Depth> constexpr unsigned int message_queue<T, Depth>::mask;
+template<typename T, unsigned int Depth> constexpr std::size_t message_queue<T, Depth>::slot_size;
+
+}
+
+#endif
@@ -0,0 +1,200 @@
+/*
+ * Copyright (c) 2012 Jeremy Pepper
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  * Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of message_queue nor the names of its contributors may
+ *    be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "message_queue_broadcast.h"
+#include "message_queue_internal.h"
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Sequence numbers wrap, so they're only ever compared by signed difference.
+ * A slot's published field is one past the sequence number of the message in
+ * it once that message is ready. gate caches the slowest cursor; producers
+ * only rescan the cursors when the cached value says they have to wait.
+ *
+ * A new consumer starts at claimpos, which may be behind gate, so it pulls
+ * gate back to its own position. While it's doing that, subscribing is
+ * nonzero and producers neither trust nor update gate: a scan that started
+ * before the new cursor was active could otherwise put gate past it again.
+ */
+
+static inline struct message_queue_broadcast_slot *broadcast_slot(struct message_queue_broadcast *queue, unsigned int sequence) {
+	return &queue->slots[sequence & (queue->max_depth - 1)];
+}
+
+static inline char *broadcast_message(struct message_queue_broadcast *queue, unsigned int sequence) {
+	return queue->memory + (size_t)queue->message_size * (sequence & (queue->max_depth - 1));
+}
+
+/*
+ * Returns nonzero if sequence's slot is free: every active consumer has
+ * released the message a ring before it.
+ */
+static int slot_free(struct message_queue_broadcast *queue, unsigned int sequence) {
+	int subscribing = __atomic_load_n(&queue->subscribing, __ATOMIC_SEQ_CST);
+	unsigned int gate = __atomic_load_n(&queue->gate, __ATOMIC_ACQUIRE);
+	if(!subscribing && (int)(sequence - gate) < (int)queue->max_depth)
+		return 1;
+	gate = sequence;
+	for(int i=0;i<queue->max_consumers;++i) {
+		struct message_queue_broadcast_cursor *cursor = &queue->cursors[i];
+		if(__atomic_load_n(&cursor->active, __ATOMIC_SEQ_CST)) {
+			unsigned int position = __atomic_load_n(&cursor->position, __ATOMIC_SEQ_CST);
+			if((int)(position - gate) < 0)
+				gate = position;
+		}
+	}
+	if(!subscribing)
+		__atomic_store_n(&queue->gate, gate, __ATOMIC_RELEASE);
+	return (int)(sequence - gate) < (int)queue->max_depth;
+}
+
+static inline void wake_all(unsigned int *wakeup, unsigned int *blocked) {
+	if(__atomic_load_n(blocked, __ATOMIC_SEQ_CST)) {
+		__sync_fetch_and_add(wakeup, 1);
+		futex_wake(wakeup, INT_MAX, 0);
+	}
+}
+
+int message_queue_broadcast_init(struct message_queue_broadcast *queue, int message_size, int max_depth, int max_consumers) {
+	if(max_consumers < 1)
+		goto error;
+	queue->message_size = pad_size(message_size);
+	queue->max_depth = round_to_pow2(max_depth);
+	queue->max_consumers = max_consumers;
+	if(posix_memalign((void **)&queue->memory, CACHE_LINE_SIZE, (size_t)queue->message_size * queue->max_depth))
+		goto error;
+	queue->slots = calloc(queue->max_depth, sizeof(struct message_queue_broadcast_slot));
+	if(!queue->slots)
+		goto error_after_memory;
+	if(posix_memalign((void **)&queue->cursors, CACHE_LINE_SIZE, sizeof(struct message_queue_broadcast_cursor) * max_consumers))
+		goto error_after_slots;
+	memset(queue->cursors, 0, sizeof(struct message_queue_broadcast_cursor) * max_consumers);
+	queue->claimpos = 0;
+	queue->gate = 0;
+	queue->subscribing = 0;
+	queue->waiters.published = 0;
+	queue->waiters.blocked_readers = 0;
+	queue->waiters.released = 0;
+	queue->waiters.blocked_writers = 0;
+	return 0;
+
+error_after_slots:
+	free(queue->slots);
+error_after_memory:
+	free(queue->memory);
+error:
+	return -1;
+}
+
+int message_queue_broadcast_subscribe(struct message_queue_broadcast *queue) {
+	for(int i=0;i<queue->max_consumers;++i) {
+		struct message_queue_broadcast_cursor *cursor = &queue->cursors[i];
+		if(!__atomic_load_n(&cursor->active, __ATOMIC_RELAXED) && __sync_bool_compare_and_swap(&cursor->active, 0, -1)) {
+			__sync_fetch_and_add(&queue->subscribing, 1);
+			unsigned int position = __atomic_load_n(&queue->claimpos, __ATOMIC_SEQ_CST);
+			__atomic_store_n(&cursor->position, position, __ATOMIC_SEQ_CST);
+			__atomic_store_n(&cursor->active, 1, __ATOMIC_SEQ_CST);
+			unsigned int gate = __atomic_load_n(&queue->gate, __ATOMIC_SEQ_CST);
+			while((int)(gate - position) > 0 && !__atomic_compare_exchange_n(&queue->gate, &gate, position, 1, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST));
+			__sync_fetch_and_add(&queue->subscribing, -1);
+			return i;
+		}
+	}
+	return -1;
+}
+
+void message_queue_broadcast_unsubscribe(struct message_queue_broadcast *queue, int consumer) {
+	__atomic_store_n(&queue->cursors[consumer].active, 0, __ATOMIC_SEQ_CST);
+	wake_all(&queue->waiters.released, &queue->waiters.blocked_writers);
+}
+
+void *message_queue_broadcast_tryclaim(struct message_queue_broadcast *queue) {
+	unsigned int sequence = __atomic_load_n(&queue->claimpos, __ATOMIC_RELAXED);
+	do {
+		if(!slot_free(queue, sequence))
+			return NULL;
+	} while(!__atomic_compare_exchange_n(&queue->claimpos, &sequence, sequence + 1, 1, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+	broadcast_slot(queue, sequence)->sequence = sequence;
+	return broadcast_message(queue, sequence);
+}
+
+void *message_queue_broadcast_claim(struct message_queue_broadcast *queue) {
+	unsigned int sequence = __sync_fetch_and_add(&queue->claimpos, 1);
+	while(!slot_free(queue, sequence)) {
+		unsigned int released = __atomic_load_n(&queue->waiters.released, __ATOMIC_ACQUIRE);
+		__sync_fetch_and_add(&queue->waiters.blocked_writers, 1);
+		if(!slot_free(queue, sequence))
+			futex_wait(&queue->waiters.released, released, 0);
+		__sync_fetch_and_add(&queue->waiters.blocked_writers, -1);
+	}
+	broadcast_slot(queue, sequence)->sequence = sequence;
+	return broadcast_message(queue, sequence);
+}
+
+void message_queue_broadcast_publish(struct message_queue_broadcast *queue, void *message) {
+	struct message_queue_broadcast_slot *slot = &queue->slots[((char *)message - queue->memory) / queue->message_size];
+	__atomic_store_n(&slot->published, slot->sequence + 1, __ATOMIC_SEQ_CST);
+	wake_all(&queue->waiters.published, &queue->waiters.blocked_readers);
+}
+
+void *message_queue_broadcast_tryread(struct message_queue_broadcast *queue, int consumer) {
+	unsigned int position = queue->cursors[consumer].position;
+	if(__atomic_load_n(&broadcast_slot(queue, position)->published, __ATOMIC_ACQUIRE) != position + 1)
+		return NULL;
+	return broadcast_message(queue, position);
+}
+
+void *message_queue_broadcast_read(struct message_queue_broadcast *queue, int consumer) {
+	void *rv = message_queue_broadcast_tryread(queue, consumer);
+	while(!rv) {
+		unsigned int published = __atomic_load_n(&queue->waiters.published, __ATOMIC_ACQUIRE);
+		__sync_fetch_and_add(&queue->waiters.blocked_readers, 1);
+		rv = message_queue_broadcast_tryread(queue, consumer);
+		if(!rv)
+			futex_wait(&queue->waiters.published, published, 0);
+		__sync_fetch_and_add(&queue->waiters.blocked_readers, -1);
+		if(!rv)
+			rv = message_queue_broadcast_tryread(queue, consumer);
+	}
+	return rv;
+}
+
+void message_queue_broadcast_release(struct message_queue_broadcast *queue, int consumer) {
+	struct message_queue_broadcast_cursor *cursor = &queue->cursors[consumer];
+	__atomic_store_n(&cursor->position, cursor->position + 1, __ATOMIC_SEQ_CST);
+	wake_all(&queue->waiters.released, &queue->waiters.blocked_writers);
+}
+
+void message_queue_broadcast_destroy(struct message_queue_broadcast *queue) {
+	free(queue->cursors);
+	free(queue->slots);
+	free(queue->memory);
+}
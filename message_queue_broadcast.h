@@ -0,0 +1,194 @@
+/*
+ * Copyright (c) 2012 Jeremy Pepper
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  * Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of message_queue nor the names of its contributors may
+ *    be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef MESSAGE_QUEUE_BROADCAST_H
+#define MESSAGE_QUEUE_BROADCAST_H
+
+#include "message_queue.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * \brief Per-slot sequence numbers for a broadcast queue
+ */
+struct message_queue_broadcast_slot {
+	unsigned int published;
+	unsigned int sequence;
+};
+
+/**
+ * \brief A broadcast queue consumer's position
+ */
+struct message_queue_broadcast_cursor {
+	unsigned int position;
+	int active;
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+/**
+ * \brief Broadcast message queue structure
+ *
+ * Every message written to a broadcast queue is seen by every consumer
+ * subscribed at the time. Messages live in a ring; producers claim slots in
+ * order and fill them in place, and each consumer follows the ring with a
+ * cursor of its own, reading messages where they are. A slot is only reused
+ * once the slowest consumer has moved past it, so one write fans out to any
+ * number of consumers without copying.
+ *
+ * This structure is passed to all message_queue_broadcast API calls
+ */
+struct message_queue_broadcast {
+	unsigned int message_size;
+	unsigned int max_depth;
+	int max_consumers;
+	char *memory;
+	struct message_queue_broadcast_slot *slots;
+	struct message_queue_broadcast_cursor *cursors;
+	unsigned int claimpos __attribute__((aligned(CACHE_LINE_SIZE)));
+	unsigned int gate __attribute__((aligned(CACHE_LINE_SIZE)));
+	int subscribing;
+	struct {
+		unsigned int published;
+		unsigned int blocked_readers;
+		unsigned int released;
+		unsigned int blocked_writers;
+	} waiters __attribute__((aligned(CACHE_LINE_SIZE)));
+};
+
+/**
+ * \brief Initialize a broadcast message queue structure
+ *
+ * \param queue pointer to the message queue structure to initialize
+ * \param message_size size in bytes of the largest message that will be sent
+ *        on this queue
+ * \param max_depth the number of messages the ring holds. This will be
+ *        rounded to the next highest power of two. Producers can get this far
+ *        ahead of the slowest consumer.
+ * \param max_consumers the most consumers that can be subscribed at once
+ *
+ * \return 0 if successful, or nonzero if an error occured
+ */
+int message_queue_broadcast_init(struct message_queue_broadcast *queue, int message_size, int max_depth, int max_consumers);
+
+/**
+ * \brief Subscribe a new consumer
+ *
+ * The consumer sees every message claimed after it subscribes.
+ *
+ * \param queue pointer to the queue
+ * \return the consumer's id, for the read calls, or -1 if max_consumers are
+ *         already subscribed
+ */
+int message_queue_broadcast_subscribe(struct message_queue_broadcast *queue);
+
+/**
+ * \brief Unsubscribe a consumer
+ *
+ * Producers stop waiting on the consumer right away, so it must not touch
+ * any message it has read after this.
+ *
+ * \param queue pointer to the queue
+ * \param consumer the consumer's id
+ */
+void message_queue_broadcast_unsubscribe(struct message_queue_broadcast *queue, int consumer);
+
+/**
+ * \brief Claim the next slot in the ring if it's free
+ *
+ * Messages claimed while nobody is subscribed are never read, and don't hold
+ * anything up.
+ *
+ * \param queue pointer to the queue
+ * \return pointer to the message to fill in, or NULL if the slowest consumer
+ *         is a whole ring behind
+ */
+void *message_queue_broadcast_tryclaim(struct message_queue_broadcast *queue);
+
+/**
+ * \brief Claim the next slot in the ring, waiting for it if need be
+ *
+ * \param queue pointer to the queue
+ * \return pointer to the message to fill in
+ */
+void *message_queue_broadcast_claim(struct message_queue_broadcast *queue);
+
+/**
+ * \brief Publish a claimed message to every consumer
+ *
+ * \param queue pointer to the queue
+ * \param message pointer to a message obtained from
+ *        message_queue_broadcast_claim or message_queue_broadcast_tryclaim
+ */
+void message_queue_broadcast_publish(struct message_queue_broadcast *queue, void *message);
+
+/**
+ * \brief Read a consumer's next message if it's been published
+ *
+ * The message stays where it is, shared with the other consumers, so treat it
+ * as read-only. Reading again before message_queue_broadcast_release returns
+ * the same message.
+ *
+ * \param queue pointer to the queue
+ * \param consumer the consumer's id
+ * \return pointer to the message, or NULL if none is available yet
+ */
+void *message_queue_broadcast_tryread(struct message_queue_broadcast *queue, int consumer);
+
+/**
+ * \brief Read a consumer's next message, waiting for it if need be
+ *
+ * \param queue pointer to the queue
+ * \param consumer the consumer's id
+ * \return pointer to the message
+ */
+void *message_queue_broadcast_read(struct message_queue_broadcast *queue, int consumer);
+
+/**
+ * \brief Move a consumer past the message it last read
+ *
+ * Once every consumer has released a message, its slot can be reused.
+ *
+ * \param queue pointer to the queue
+ * \param consumer the consumer's id
+ */
+void message_queue_broadcast_release(struct message_queue_broadcast *queue, int consumer);
+
+/**
+ * \brief Destroy a broadcast message queue structure
+ *
+ * \param queue pointer to the message queue to destroy
+ */
+void message_queue_broadcast_destroy(struct message_queue_broadcast *queue);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,159 @@
+/*
+ * Copyright (c) 2012 Jeremy Pepper
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  * Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of message_queue nor the names of its contributors may
+ *    be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "message_queue_embedded.h"
+#include "message_queue_internal.h"
+#include <limits.h>
+#include <stdlib.h>
+
+/*
+ * Slots follow Vyukov's bounded queue: a slot's sequence number is its
+ * position while it waits for that position's writer, position + 1 once the
+ * message is published, and position + max_depth once it's been released
+ * for the next lap. Positions only move by compare-and-swap after the slot
+ * has been checked, so reading an empty ring or claiming in a full one
+ * leaves them alone.
+ *
+ * Blocked threads are woken one at a time. A reader that gets a message
+ * while others are still blocked wakes another if there's more to read, so a
+ * wakeup spent on a reader held up behind an unpublished slot gets passed
+ * along. Writers do the same with free slots.
+ */
+#define SLOT_HEADER pad_size(sizeof(unsigned int))
+
+static inline unsigned int *slot_seq(struct message_queue_embedded *queue, unsigned int pos) {
+	return (unsigned int *)(queue->slots + (size_t)queue->slot_size * (pos & (queue->max_depth - 1)));
+}
+
+static inline unsigned int *message_seq(void *message) {
+	return (unsigned int *)((char *)message - SLOT_HEADER);
+}
+
+static inline void wake_one(unsigned int *wakeup, unsigned int *blocked) {
+	if(__atomic_load_n(blocked, __ATOMIC_SEQ_CST)) {
+		__sync_fetch_and_add(wakeup, 1);
+		futex_wake(wakeup, 1, 0);
+	}
+}
+
+/*
+ * Takes the slot at *position if its sequence number is position + offset:
+ * 0 for writers looking for a free slot, 1 for readers looking for a
+ * message.
+ */
+static void *take_slot(struct message_queue_embedded *queue, unsigned int *position, unsigned int offset) {
+	unsigned int pos = __atomic_load_n(position, __ATOMIC_RELAXED);
+	for(;;) {
+		unsigned int *seq = slot_seq(queue, pos);
+		int diff = (int)(__atomic_load_n(seq, __ATOMIC_ACQUIRE) - (pos + offset));
+		if(diff == 0) {
+			if(__atomic_compare_exchange_n(position, &pos, pos + 1, 1, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+				return (char *)seq + SLOT_HEADER;
+		} else if(diff < 0) {
+			return NULL;
+		} else {
+			pos = __atomic_load_n(position, __ATOMIC_RELAXED);
+		}
+	}
+}
+
+static inline int slot_ready(struct message_queue_embedded *queue, unsigned int *position, unsigned int offset) {
+	unsigned int pos = __atomic_load_n(position, __ATOMIC_SEQ_CST);
+	return __atomic_load_n(slot_seq(queue, pos), __ATOMIC_SEQ_CST) == pos + offset;
+}
+
+static void *wait_slot(struct message_queue_embedded *queue, unsigned int *position, unsigned int offset, unsigned int *wakeup, unsigned int *blocked) {
+	void *rv = take_slot(queue, position, offset);
+	while(!rv) {
+		unsigned int w = __atomic_load_n(wakeup, __ATOMIC_ACQUIRE);
+		__sync_fetch_and_add(blocked, 1);
+		rv = take_slot(queue, position, offset);
+		if(!rv)
+			futex_wait(wakeup, w, 0);
+		__sync_fetch_and_add(blocked, -1);
+		if(!rv)
+			rv = take_slot(queue, position, offset);
+	}
+	if(__atomic_load_n(blocked, __ATOMIC_SEQ_CST) && slot_ready(queue, position, offset))
+		wake_one(wakeup, blocked);
+	return rv;
+}
+
+int message_queue_embedded_init(struct message_queue_embedded *queue, int message_size, int max_depth) {
+	if(message_size < 1 || max_depth < 1)
+		return -1;
+	queue->message_size = message_size;
+	queue->slot_size = (SLOT_HEADER + message_size + CACHE_LINE_SIZE - 1) & ~(CACHE_LINE_SIZE - 1);
+	// Full and empty slots can only be told apart with at least two of them
+	queue->max_depth = round_to_pow2(max_depth < 2 ? 2 : max_depth);
+	if(posix_memalign((void **)&queue->slots, CACHE_LINE_SIZE, (size_t)queue->slot_size * queue->max_depth))
+		return -1;
+	for(unsigned int i=0;i<queue->max_depth;++i) {
+		*slot_seq(queue, i) = i;
+	}
+	queue->readpos = 0;
+	queue->writepos = 0;
+	queue->waiters.published = 0;
+	queue->waiters.blocked_readers = 0;
+	queue->waiters.released = 0;
+	queue->waiters.blocked_writers = 0;
+	return 0;
+}
+
+void *message_queue_embedded_tryclaim(struct message_queue_embedded *queue) {
+	return take_slot(queue, &queue->writepos, 0);
+}
+
+void *message_queue_embedded_claim(struct message_queue_embedded *queue) {
+	return wait_slot(queue, &queue->writepos, 0, &queue->waiters.released, &queue->waiters.blocked_writers);
+}
+
+void message_queue_embedded_publish(struct message_queue_embedded *queue, void *message) {
+	unsigned int *seq = message_seq(message);
+	__atomic_store_n(seq, *seq + 1, __ATOMIC_SEQ_CST);
+	wake_one(&queue->waiters.published, &queue->waiters.blocked_readers);
+}
+
+void *message_queue_embedded_tryread(struct message_queue_embedded *queue) {
+	return take_slot(queue, &queue->readpos, 1);
+}
+
+void *message_queue_embedded_read(struct message_queue_embedded *queue) {
+	return wait_slot(queue, &queue->readpos, 1, &queue->waiters.published, &queue->waiters.blocked_readers);
+}
+
+void message_queue_embedded_release(struct message_queue_embedded *queue, void *message) {
+	unsigned int *seq = message_seq(message);
+	__atomic_store_n(seq, *seq + queue->max_depth - 1, __ATOMIC_SEQ_CST);
+	wake_one(&queue->waiters.released, &queue->waiters.blocked_writers);
+}
+
+void message_queue_embedded_destroy(struct message_queue_embedded *queue) {
+	free(queue->slots);
+}
@@ -0,0 +1,148 @@
+/*
+ * Copyright (c) 2012 Jeremy Pepper
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  * Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of message_queue nor the names of its contributors may
+ *    be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef MESSAGE_QUEUE_EMBEDDED_H
+#define MESSAGE_QUEUE_EMBEDDED_H
+
+#include "message_queue.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * \brief Embedded message queue structure
+ *
+ * For small, fixed-size messages. Each message lives right in its ring slot,
+ * next to the slot's sequence number, so there's no separate message memory
+ * and no freelist: writers fill in a slot and publish it, and readers use the
+ * message where it is and release the slot. A slot's sequence number takes
+ * 8 bytes, so with messages of up to 56 bytes (on 64 byte cache lines) a
+ * message and its sequence number share one cache line, and the only shared
+ * counters are the read and write positions.
+ *
+ * This structure is passed to all message_queue_embedded API calls
+ */
+struct message_queue_embedded {
+	unsigned int message_size;
+	unsigned int slot_size;
+	unsigned int max_depth;
+	char *slots;
+	unsigned int readpos __attribute__((aligned(CACHE_LINE_SIZE)));
+	unsigned int writepos __attribute__((aligned(CACHE_LINE_SIZE)));
+	struct {
+		unsigned int published;
+		unsigned int blocked_readers;
+		unsigned int released;
+		unsigned int blocked_writers;
+	} waiters __attribute__((aligned(CACHE_LINE_SIZE)));
+};
+
+/**
+ * \brief Initialize an embedded message queue structure
+ *
+ * \param queue pointer to the message queue structure to initialize
+ * \param message_size size in bytes of the messages. Slots are rounded up to
+ *        a whole number of cache lines, so bigger messages work but lose
+ *        the point.
+ * \param max_depth the number of messages the ring holds, at least 1. This
+ *        will be rounded to the next highest power of two, and up to 2 if
+ *        it's 1.
+ *
+ * \return 0 if successful, or nonzero if an error occured
+ */
+int message_queue_embedded_init(struct message_queue_embedded *queue, int message_size, int max_depth);
+
+/**
+ * \brief Claim the next slot in the ring if it's free
+ *
+ * \param queue pointer to the queue
+ * \return pointer to the message to fill in, or NULL if the ring is full
+ */
+void *message_queue_embedded_tryclaim(struct message_queue_embedded *queue);
+
+/**
+ * \brief Claim the next slot in the ring, waiting for one if need be
+ *
+ * \param queue pointer to the queue
+ * \return pointer to the message to fill in
+ */
+void *message_queue_embedded_claim(struct message_queue_embedded *queue);
+
+/**
+ * \brief Publish a claimed message to the readers
+ *
+ * Readers take messages in the order their slots were claimed, so a slot
+ * claimed but not yet published holds up the ones after it.
+ *
+ * \param queue pointer to the queue
+ * \param message pointer to a message obtained from
+ *        message_queue_embedded_claim or message_queue_embedded_tryclaim
+ */
+void message_queue_embedded_publish(struct message_queue_embedded *queue, void *message);
+
+/**
+ * \brief Read a message from the queue if one is available
+ *
+ * The message stays in its slot until it's released.
+ *
+ * \param queue pointer to the queue
+ * \return pointer to the message, or NULL if none is available
+ */
+void *message_queue_embedded_tryread(struct message_queue_embedded *queue);
+
+/**
+ * \brief Read a message from the queue, waiting for one if need be
+ *
+ * \param queue pointer to the queue
+ * \return pointer to the message
+ */
+void *message_queue_embedded_read(struct message_queue_embedded *queue);
+
+/**
+ * \brief Release a message's slot so it can be written again
+ *
+ * \param queue pointer to the queue
+ * \param message pointer to a message obtained from
+ *        message_queue_embedded_read or message_queue_embedded_tryread
+ */
+void message_queue_embedded_release(struct message_queue_embedded *queue, void *message);
+
+/**
+ * \brief Destroy an embedded message queue structure
+ *
+ * \param queue pointer to the message queue to destroy
+ */
+void message_queue_embedded_destroy(struct message_queue_embedded *queue);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
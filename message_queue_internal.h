@@ -0,0 +1,115 @@
+/*
+ * Copyright (c) 2012 Jeremy Pepper
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  * Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of message_queue nor the names of its contributors may
+ *    be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Helpers shared by the message queue implementations. Not part of the public
+ * API.
+ */
+
+#ifndef MESSAGE_QUEUE_INTERNAL_H
+#define MESSAGE_QUEUE_INTERNAL_H
+
+#include <inttypes.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+union padding {
+	char chardata;
+	short shortdata;
+	int intdata;
+	long longdata;
+	float floatdata;
+	double doubledata;
+	void *pointerdata;
+};
+
+static inline int pad_size(int size) {
+	return size % sizeof(union padding) ?
+	       (size + (sizeof(union padding) - (size % sizeof(union padding)))) :
+		   size;
+}
+
+static inline uint32_t round_to_pow2(uint32_t x) {
+	x--;
+	x |= x >> 1;
+	x |= x >> 2;
+	x |= x >> 4;
+	x |= x >> 8;
+	x |= x >> 16;
+	x++;
+	return x;
+}
+
+static inline void cpu_relax() {
+#if defined(__i386__) || defined(__x86_64__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__)
+	__asm__ __volatile__("yield" ::: "memory");
+#else
+	__sync_synchronize();
+#endif
+}
+
+/*
+ * shared is nonzero for futex words that live in memory shared between
+ * processes; everything else can use the cheaper private futexes.
+ */
+#ifdef __linux__
+static inline void futex_wait_timeout(unsigned int *addr, unsigned int val, int shared, const struct timespec *timeout) {
+	syscall(SYS_futex, addr, shared ? FUTEX_WAIT : FUTEX_WAIT_PRIVATE, val, timeout, NULL, 0);
+}
+
+static inline void futex_wait(unsigned int *addr, unsigned int val, int shared) {
+	futex_wait_timeout(addr, val, shared, NULL);
+}
+
+static inline void futex_wake(unsigned int *addr, int count, int shared) {
+	syscall(SYS_futex, addr, shared ? FUTEX_WAKE : FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
+#else
+// No futexes here, so waiters just yield until the word changes
+static inline void futex_wait(unsigned int *addr, unsigned int val, int shared) {
+	if(__atomic_load_n(addr, __ATOMIC_ACQUIRE) == val)
+		sched_yield();
+}
+
+static inline void futex_wait_timeout(unsigned int *addr, unsigned int val, int shared, const struct timespec *timeout) {
+	futex_wait(addr, val, shared);
+}
+
+static inline void futex_wake(unsigned int *addr, int count, int shared) {
+}
+#endif
+
+#endif
@@ -0,0 +1,271 @@
+/*
+ * Copyright (c) 2012 Jeremy Pepper
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  * Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of message_queue nor the names of its contributors may
+ *    be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "message_queue_pool.h"
+#include "message_queue_internal.h"
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef POOL_INJECTOR_INTERVAL
+#define POOL_INJECTOR_INTERVAL 61
+#endif
+
+/*
+ * Each worker's deque is a fixed-size Chase-Lev deque (in the form given by
+ * Le, Pop, Cohen and Zappa Nardelli). The owner pushes and pops at bottom;
+ * thieves take from top. It's as big as the whole pool, so it can only fill
+ * up if something else has gone wrong; if it does, messages go to the
+ * injection queue instead.
+ */
+struct message_queue_pool_worker {
+	long top __attribute__((aligned(CACHE_LINE_SIZE)));
+	long bottom __attribute__((aligned(CACHE_LINE_SIZE)));
+	void **buffer;
+	long mask;
+	struct message_queue_pool *pool;
+	pthread_t thread;
+	unsigned int seed;
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+static __thread struct message_queue_pool_worker *current_worker;
+
+static int deque_push(struct message_queue_pool_worker *worker, void *message) {
+	long bottom = __atomic_load_n(&worker->bottom, __ATOMIC_RELAXED);
+	long top = __atomic_load_n(&worker->top, __ATOMIC_ACQUIRE);
+	if(bottom - top > worker->mask)
+		return -1;
+	__atomic_store_n(&worker->buffer[bottom & worker->mask], message, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	__atomic_store_n(&worker->bottom, bottom + 1, __ATOMIC_RELAXED);
+	return 0;
+}
+
+static void *deque_pop(struct message_queue_pool_worker *worker) {
+	long bottom = __atomic_load_n(&worker->bottom, __ATOMIC_RELAXED) - 1;
+	void *message = NULL;
+	__atomic_store_n(&worker->bottom, bottom, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	long top = __atomic_load_n(&worker->top, __ATOMIC_RELAXED);
+	if(top <= bottom) {
+		message = __atomic_load_n(&worker->buffer[bottom & worker->mask], __ATOMIC_RELAXED);
+		if(top == bottom) {
+			// Last one: race the thieves for it
+			if(!__atomic_compare_exchange_n(&worker->top, &top, top + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+				message = NULL;
+			__atomic_store_n(&worker->bottom, bottom + 1, __ATOMIC_RELAXED);
+		}
+	} else {
+		__atomic_store_n(&worker->bottom, bottom + 1, __ATOMIC_RELAXED);
+	}
+	return message;
+}
+
+static void *deque_steal(struct message_queue_pool_worker *worker) {
+	long top = __atomic_load_n(&worker->top, __ATOMIC_ACQUIRE);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	long bottom = __atomic_load_n(&worker->bottom, __ATOMIC_ACQUIRE);
+	if(top < bottom) {
+		void *message = __atomic_load_n(&worker->buffer[top & worker->mask], __ATOMIC_RELAXED);
+		if(__atomic_compare_exchange_n(&worker->top, &top, top + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+			return message;
+	}
+	return NULL;
+}
+
+static inline int deque_empty(struct message_queue_pool_worker *worker) {
+	return __atomic_load_n(&worker->top, __ATOMIC_SEQ_CST) >= __atomic_load_n(&worker->bottom, __ATOMIC_SEQ_CST);
+}
+
+/*
+ * Idle workers park on wakeup. Submitters only touch it when sleepers says
+ * somebody's parked, and a worker counts itself as a sleeper before its last
+ * look for work, so no submission can slip past both.
+ */
+static void wake_worker(struct message_queue_pool *pool) {
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if(__atomic_load_n(&pool->sleepers, __ATOMIC_SEQ_CST)) {
+		__sync_fetch_and_add(&pool->wakeup, 1);
+		futex_wake(&pool->wakeup, 1, 0);
+	}
+}
+
+static int has_work(struct message_queue_pool *pool) {
+	if(__atomic_load_n(&pool->injector.queue.entries, __ATOMIC_SEQ_CST) > 0)
+		return 1;
+	for(int i=0;i<pool->num_workers;++i) {
+		if(!deque_empty(&pool->workers[i]))
+			return 1;
+	}
+	return 0;
+}
+
+static void *find_work(struct message_queue_pool_worker *worker) {
+	struct message_queue_pool *pool = worker->pool;
+	void *message = message_queue_tryread(&pool->injector);
+	if(message)
+		return message;
+	// Start from a random victim so thieves spread out
+	worker->seed ^= worker->seed << 13;
+	worker->seed ^= worker->seed >> 17;
+	worker->seed ^= worker->seed << 5;
+	int start = worker->seed % pool->num_workers;
+	for(int i=0;i<pool->num_workers;++i) {
+		struct message_queue_pool_worker *victim = &pool->workers[(start + i) % pool->num_workers];
+		if(victim != worker && (message = deque_steal(victim)))
+			return message;
+	}
+	return NULL;
+}
+
+/*
+ * Returns nonzero once the pool is stopping and there's nothing left to do.
+ */
+static int park(struct message_queue_pool *pool) {
+	int rv = 0;
+	unsigned int wakeup = __atomic_load_n(&pool->wakeup, __ATOMIC_ACQUIRE);
+	__sync_fetch_and_add(&pool->sleepers, 1);
+	if(!has_work(pool)) {
+		if(__atomic_load_n(&pool->stopping, __ATOMIC_SEQ_CST))
+			rv = 1;
+		else
+			futex_wait(&pool->wakeup, wakeup, 0);
+	}
+	__sync_fetch_and_add(&pool->sleepers, -1);
+	return rv;
+}
+
+static void *worker_threadproc(void *arg) {
+	struct message_queue_pool_worker *worker = arg;
+	struct message_queue_pool *pool = worker->pool;
+	unsigned int ticks = 0;
+	current_worker = worker;
+	while(1) {
+		void *message = NULL;
+		// Look at the injection queue now and then, even when busy
+		if(++ticks % POOL_INJECTOR_INTERVAL == 0)
+			message = message_queue_tryread(&pool->injector);
+		if(!message)
+			message = deque_pop(worker);
+		if(!message)
+			message = find_work(worker);
+		if(!message) {
+			if(park(pool))
+				break;
+			continue;
+		}
+		pool->handler(message, pool->context);
+		message_queue_message_free(&pool->injector, message);
+	}
+	current_worker = NULL;
+	return NULL;
+}
+
+int message_queue_pool_init(struct message_queue_pool *pool, int workers, int message_size, int max_depth, void (*handler)(void *message, void *context), void *context) {
+	int started = 0;
+	if(workers < 1)
+		goto error;
+	if(message_queue_init(&pool->injector, message_size, max_depth))
+		goto error;
+	pool->handler = handler;
+	pool->context = context;
+	pool->num_workers = workers;
+	pool->wakeup = 0;
+	pool->sleepers = 0;
+	pool->stopping = 0;
+	if(posix_memalign((void **)&pool->workers, CACHE_LINE_SIZE, sizeof(struct message_queue_pool_worker) * workers))
+		goto error_after_injector;
+	memset(pool->workers, 0, sizeof(struct message_queue_pool_worker) * workers);
+	for(int i=0;i<workers;++i) {
+		struct message_queue_pool_worker *worker = &pool->workers[i];
+		worker->top = 0;
+		worker->bottom = 0;
+		worker->mask = pool->injector.max_depth - 1;
+		worker->pool = pool;
+		worker->seed = i + 1;
+		worker->buffer = malloc(sizeof(void *) * pool->injector.max_depth);
+		if(!worker->buffer)
+			goto error_after_buffers;
+	}
+	for(;started<workers;++started) {
+		if(pthread_create(&pool->workers[started].thread, NULL, &worker_threadproc, &pool->workers[started]))
+			goto error_after_threads;
+	}
+	return 0;
+
+error_after_threads:
+	__atomic_store_n(&pool->stopping, 1, __ATOMIC_SEQ_CST);
+	__sync_fetch_and_add(&pool->wakeup, 1);
+	futex_wake(&pool->wakeup, INT_MAX, 0);
+	for(int i=0;i<started;++i) {
+		pthread_join(pool->workers[i].thread, NULL);
+	}
+error_after_buffers:
+	for(int i=0;i<workers;++i) {
+		free(pool->workers[i].buffer);
+	}
+	free(pool->workers);
+error_after_injector:
+	message_queue_destroy(&pool->injector);
+error:
+	return -1;
+}
+
+void *message_queue_pool_message_alloc(struct message_queue_pool *pool) {
+	return message_queue_message_alloc(&pool->injector);
+}
+
+void *message_queue_pool_message_alloc_blocking(struct message_queue_pool *pool) {
+	return message_queue_message_alloc_blocking(&pool->injector);
+}
+
+void message_queue_pool_message_free(struct message_queue_pool *pool, void *message) {
+	message_queue_message_free(&pool->injector, message);
+}
+
+void message_queue_pool_submit(struct message_queue_pool *pool, void *message) {
+	struct message_queue_pool_worker *worker = current_worker;
+	if(!worker || worker->pool != pool || deque_push(worker, message))
+		message_queue_write(&pool->injector, message);
+	wake_worker(pool);
+}
+
+void message_queue_pool_destroy(struct message_queue_pool *pool) {
+	__atomic_store_n(&pool->stopping, 1, __ATOMIC_SEQ_CST);
+	__sync_fetch_and_add(&pool->wakeup, 1);
+	futex_wake(&pool->wakeup, INT_MAX, 0);
+	for(int i=0;i<pool->num_workers;++i) {
+		pthread_join(pool->workers[i].thread, NULL);
+	}
+	for(int i=0;i<pool->num_workers;++i) {
+		free(pool->workers[i].buffer);
+	}
+	free(pool->workers);
+	message_queue_destroy(&pool->injector);
+}
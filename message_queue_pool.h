@@ -0,0 +1,136 @@
+/*
+ * Copyright (c) 2012 Jeremy Pepper
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  * Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of message_queue nor the names of its contributors may
+ *    be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef MESSAGE_QUEUE_POOL_H
+#define MESSAGE_QUEUE_POOL_H
+
+#include "message_queue.h"
+#include <pthread.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct message_queue_pool_worker;
+
+/**
+ * \brief Work-stealing thread pool structure
+ *
+ * Each worker has a deque of its own. Messages submitted from a worker go on
+ * that worker's deque, and it takes them back off the same end; messages
+ * submitted from any other thread go on a shared injection queue. A worker
+ * with nothing to do takes from the injection queue or steals from the other
+ * end of another worker's deque, so workers mostly stay off each other's
+ * cache lines.
+ *
+ * This structure is passed to all message_queue_pool API calls. Like struct
+ * message_queue, it must not be moved or copied once it has been initialized.
+ */
+struct message_queue_pool {
+	struct message_queue injector;
+	void (*handler)(void *message, void *context);
+	void *context;
+	int num_workers;
+	struct message_queue_pool_worker *workers;
+	unsigned int wakeup __attribute__((aligned(CACHE_LINE_SIZE)));
+	unsigned int sleepers;
+	int stopping;
+};
+
+/**
+ * \brief Initialize a thread pool and start its workers
+ *
+ * \param pool pointer to the pool structure to initialize
+ * \param workers the number of worker threads
+ * \param message_size size in bytes of the largest message that will be
+ *        submitted to this pool
+ * \param max_depth the maximum number of messages to allow in the pool at
+ *        once. This will be rounded to the next highest power of two.
+ * \param handler function called on a worker thread for each message
+ *        submitted. The pool frees the message once the handler returns.
+ * \param context passed to every call to handler
+ *
+ * \return 0 if successful, or nonzero if an error occured
+ */
+int message_queue_pool_init(struct message_queue_pool *pool, int workers, int message_size, int max_depth, void (*handler)(void *message, void *context), void *context);
+
+/**
+ * \brief Allocate a new message for the pool
+ *
+ * \param pool pointer to the pool
+ * \return pointer to the allocated message, or NULL if no memory is available
+ */
+void *message_queue_pool_message_alloc(struct message_queue_pool *pool);
+
+/**
+ * \brief Allocate a new message for the pool, waiting for one if need be
+ *
+ * Handlers that allocate this way can deadlock the pool if every message is
+ * waiting on a worker that's waiting in here, so size the pool accordingly.
+ *
+ * \param pool pointer to the pool
+ * \return pointer to the allocated message
+ */
+void *message_queue_pool_message_alloc_blocking(struct message_queue_pool *pool);
+
+/**
+ * \brief Free a message that won't be submitted after all
+ *
+ * \param pool pointer to the pool
+ * \param message pointer to the message to free
+ */
+void message_queue_pool_message_free(struct message_queue_pool *pool, void *message);
+
+/**
+ * \brief Submit a message to be handled by one of the pool's workers
+ *
+ * Called from a worker, this puts the message on that worker's own deque;
+ * from anywhere else, it goes on the injection queue.
+ *
+ * \param pool pointer to the pool
+ * \param message pointer to a message obtained from
+ *        message_queue_pool_message_alloc
+ */
+void message_queue_pool_submit(struct message_queue_pool *pool, void *message);
+
+/**
+ * \brief Stop a thread pool and destroy it
+ *
+ * Messages that have already been submitted are handled first, along with
+ * any that their handlers submit. This must not be called from a worker.
+ *
+ * \param pool pointer to the pool to destroy
+ */
+void message_queue_pool_destroy(struct message_queue_pool *pool);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,184 @@
+/*
+ * Copyright (c) 2012 Jeremy Pepper
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  * Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of message_queue nor the names of its contributors may
+ *    be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "message_queue_spsc.h"
+#include "message_queue_internal.h"
+#include <pthread.h>
+#include <stdlib.h>
+#ifdef __linux__
+#include <linux/membarrier.h>
+#endif
+
+/*
+ * Neither ring can overflow: there are only max_depth messages, so a position
+ * can't come round again until the other side has finished with it. The only
+ * thing either side ever has to check is whether the ring is empty.
+ *
+ * A writer mustn't miss a reader that's about to park, which takes a full
+ * fence on both sides between storing a position and loading the other
+ * side's flag. That fence is split unevenly: writes and frees only stop the
+ * compiler from reordering, and a thread about to park runs membarrier,
+ * which makes every other running thread in the process execute a full
+ * fence. Without membarrier, writes and frees fall back to a real fence.
+ */
+
+static pthread_once_t membarrier_once = PTHREAD_ONCE_INIT;
+static int have_membarrier;
+
+static void register_membarrier() {
+#if defined(__linux__) && defined(SYS_membarrier)
+	if(!syscall(SYS_membarrier, MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED, 0, 0))
+		have_membarrier = 1;
+#endif
+}
+
+static inline void light_fence() {
+	__atomic_signal_fence(__ATOMIC_SEQ_CST);
+	if(!__atomic_load_n(&have_membarrier, __ATOMIC_RELAXED))
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+static void heavy_fence() {
+#if defined(__linux__) && defined(SYS_membarrier)
+	if(have_membarrier && !syscall(SYS_membarrier, MEMBARRIER_CMD_PRIVATE_EXPEDITED, 0, 0))
+		return;
+#endif
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+int message_queue_spsc_init(struct message_queue_spsc *queue, int message_size, int max_depth) {
+	// Before any queue exists, so every thread agrees on have_membarrier
+	pthread_once(&membarrier_once, &register_membarrier);
+	queue->message_size = pad_size(message_size);
+	queue->max_depth = round_to_pow2(max_depth);
+	queue->memory = malloc(queue->message_size * queue->max_depth);
+	if(!queue->memory)
+		goto error;
+	queue->freelist = malloc(sizeof(void *) * queue->max_depth);
+	if(!queue->freelist)
+		goto error_after_memory;
+	for(int i=0;i<queue->max_depth;++i) {
+		queue->freelist[i] = (char *)queue->memory + (queue->message_size * i);
+	}
+	queue->queue_data = malloc(sizeof(void *) * queue->max_depth);
+	if(!queue->queue_data)
+		goto error_after_freelist;
+	queue->producer.writepos = 0;
+	queue->producer.allocpos = 0;
+	queue->producer.freepos_cache = queue->max_depth;
+	queue->consumer.freepos = queue->max_depth;
+	queue->consumer.readpos = 0;
+	queue->consumer.writepos_cache = 0;
+	queue->waiters.blocked_reader = 0;
+	queue->waiters.blocked_allocator = 0;
+	return 0;
+
+error_after_freelist:
+	free(queue->freelist);
+error_after_memory:
+	free(queue->memory);
+error:
+	return -1;
+}
+
+void *message_queue_spsc_message_alloc(struct message_queue_spsc *queue) {
+	unsigned int pos = queue->producer.allocpos;
+	if(pos == queue->producer.freepos_cache) {
+		queue->producer.freepos_cache = __atomic_load_n(&queue->consumer.freepos, __ATOMIC_ACQUIRE);
+		if(pos == queue->producer.freepos_cache)
+			return NULL;
+	}
+	queue->producer.allocpos = pos + 1;
+	return queue->freelist[pos & (queue->max_depth - 1)];
+}
+
+void *message_queue_spsc_message_alloc_blocking(struct message_queue_spsc *queue) {
+	void *rv = message_queue_spsc_message_alloc(queue);
+	while(!rv) {
+		__atomic_store_n(&queue->waiters.blocked_allocator, 1, __ATOMIC_RELAXED);
+		heavy_fence();
+		rv = message_queue_spsc_message_alloc(queue);
+		if(!rv)
+			futex_wait(&queue->consumer.freepos, queue->producer.allocpos, 0);
+		__atomic_store_n(&queue->waiters.blocked_allocator, 0, __ATOMIC_RELAXED);
+		if(!rv)
+			rv = message_queue_spsc_message_alloc(queue);
+	}
+	return rv;
+}
+
+void message_queue_spsc_message_free(struct message_queue_spsc *queue, void *message) {
+	unsigned int pos = queue->consumer.freepos;
+	queue->freelist[pos & (queue->max_depth - 1)] = message;
+	__atomic_store_n(&queue->consumer.freepos, pos + 1, __ATOMIC_RELEASE);
+	light_fence();
+	if(__atomic_load_n(&queue->waiters.blocked_allocator, __ATOMIC_RELAXED))
+		futex_wake(&queue->consumer.freepos, 1, 0);
+}
+
+void message_queue_spsc_write(struct message_queue_spsc *queue, void *message) {
+	unsigned int pos = queue->producer.writepos;
+	queue->queue_data[pos & (queue->max_depth - 1)] = message;
+	__atomic_store_n(&queue->producer.writepos, pos + 1, __ATOMIC_RELEASE);
+	light_fence();
+	if(__atomic_load_n(&queue->waiters.blocked_reader, __ATOMIC_RELAXED))
+		futex_wake(&queue->producer.writepos, 1, 0);
+}
+
+void *message_queue_spsc_tryread(struct message_queue_spsc *queue) {
+	unsigned int pos = queue->consumer.readpos;
+	if(pos == queue->consumer.writepos_cache) {
+		queue->consumer.writepos_cache = __atomic_load_n(&queue->producer.writepos, __ATOMIC_ACQUIRE);
+		if(pos == queue->consumer.writepos_cache)
+			return NULL;
+	}
+	queue->consumer.readpos = pos + 1;
+	return queue->queue_data[pos & (queue->max_depth - 1)];
+}
+
+void *message_queue_spsc_read(struct message_queue_spsc *queue) {
+	void *rv = message_queue_spsc_tryread(queue);
+	while(!rv) {
+		__atomic_store_n(&queue->waiters.blocked_reader, 1, __ATOMIC_RELAXED);
+		heavy_fence();
+		rv = message_queue_spsc_tryread(queue);
+		if(!rv)
+			futex_wait(&queue->producer.writepos, queue->consumer.readpos, 0);
+		__atomic_store_n(&queue->waiters.blocked_reader, 0, __ATOMIC_RELAXED);
+		if(!rv)
+			rv = message_queue_spsc_tryread(queue);
+	}
+	return rv;
+}
+
+void message_queue_spsc_destroy(struct message_queue_spsc *queue) {
+	free(queue->queue_data);
+	free(queue->freelist);
+	free(queue->memory);
+}
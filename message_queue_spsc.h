@@ -0,0 +1,168 @@
+/*
+ * Copyright (c) 2012 Jeremy Pepper
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  * Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of message_queue nor the names of its contributors may
+ *    be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef MESSAGE_QUEUE_SPSC_H
+#define MESSAGE_QUEUE_SPSC_H
+
+#include "message_queue.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * \brief Single-producer/single-consumer message queue structure
+ *
+ * This works just like struct message_queue, but only one thread may allocate
+ * and write messages and only one thread may read and free them. In exchange,
+ * no operation needs an atomic read-modify-write: each side owns its own
+ * positions and keeps a cached copy of the other side's, only rereading it
+ * when the cache says the ring is empty.
+ *
+ * This structure is passed to all message_queue_spsc API calls
+ */
+struct message_queue_spsc {
+	unsigned int message_size;
+	unsigned int max_depth;
+	void *memory;
+	void **freelist;
+	void **queue_data;
+	struct {
+		unsigned int writepos;
+		unsigned int allocpos;
+		unsigned int freepos_cache;
+	} producer __attribute__((aligned(CACHE_LINE_SIZE)));
+	struct {
+		unsigned int freepos;
+		unsigned int readpos;
+		unsigned int writepos_cache;
+	} consumer __attribute__((aligned(CACHE_LINE_SIZE)));
+	struct {
+		unsigned int blocked_reader;
+		unsigned int blocked_allocator;
+	} waiters __attribute__((aligned(CACHE_LINE_SIZE)));
+};
+
+/**
+ * \brief Initialize a single-producer/single-consumer message queue structure
+ *
+ * This function must be called before any other message_queue_spsc API calls
+ * on a message queue structure.
+ *
+ * \param queue pointer to the message queue structure to initialize
+ * \param message_size size in bytes of the largest message that will be sent
+ *        on this queue
+ * \param max_depth the maximum number of message to allow in the queue at
+ *        once. This will be rounded to the next highest power of two.
+ *
+ * \return 0 if successful, or nonzero if an error occured
+ */
+int message_queue_spsc_init(struct message_queue_spsc *queue, int message_size, int max_depth);
+
+/**
+ * \brief Allocate a new message
+ *
+ * This may only be called from the producer thread.
+ *
+ * \param queue pointer to the message queue to which the message will be
+ *        written
+ * \return pointer to the allocated message, or NULL if no memory is available
+ */
+void *message_queue_spsc_message_alloc(struct message_queue_spsc *queue);
+
+/**
+ * \brief Allocate a new message
+ *
+ * This may only be called from the producer thread. It blocks until memory is
+ * available.
+ *
+ * \param queue pointer to the message queue to which the message will be
+ *        written
+ * \return pointer to the allocated message
+ */
+void *message_queue_spsc_message_alloc_blocking(struct message_queue_spsc *queue);
+
+/**
+ * \brief Free a message
+ *
+ * This may only be called from the consumer thread, and only with messages
+ * read from the queue.
+ *
+ * \param queue pointer to the message queue from which the message was
+ *        allocated
+ * \param message pointer to the message to be freed
+ */
+void message_queue_spsc_message_free(struct message_queue_spsc *queue, void *message);
+
+/**
+ * \brief Write a message to the queue
+ *
+ * This may only be called from the producer thread.
+ *
+ * \param queue pointer to the queue to which to write
+ * \param message pointer to the message to write to the queue
+ */
+void message_queue_spsc_write(struct message_queue_spsc *queue, void *message);
+
+/**
+ * \brief Read a message from the queue if one is available
+ *
+ * This may only be called from the consumer thread.
+ *
+ * \param queue pointer to the queue from which to read
+ * \return pointer to the next message on the queue, or NULL if no messages
+ *         are available.
+ */
+void *message_queue_spsc_tryread(struct message_queue_spsc *queue);
+
+/**
+ * \brief Read a message from the queue
+ *
+ * This may only be called from the consumer thread. It blocks until a message
+ * is available.
+ *
+ * \param queue pointer to the queue from which to read
+ * \return pointer to the next message on the queue
+ */
+void *message_queue_spsc_read(struct message_queue_spsc *queue);
+
+/**
+ * \brief Destroy a single-producer/single-consumer message queue structure
+ *
+ * This frees any resources associated with the message queue.
+ *
+ * \param queue pointer to the message queue to destroy
+ */
+void message_queue_spsc_destroy(struct message_queue_spsc *queue);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,161 @@
+/*
+ * Copyright (c) 2012 Jeremy Pepper
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  * Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of message_queue nor the names of its contributors may
+ *    be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Magazines combined with size classes and with growth. Freeing through a
+ * magazine must reach each message's own freelist without coming back to the
+ * magazine, and dropping magazines must not take the magazine lock twice.
+ */
+
+#include "message_queue.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define THREADS 4
+#define ROUNDS 20000
+#define HELD 24
+
+#define CHECK(cond) do { \
+	if(!(cond)) { \
+		fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+		exit(1); \
+	} \
+} while(0)
+
+static struct message_queue queue;
+
+static void *classes_threadproc(void *arg) {
+	for(int i=0;i<ROUNDS;++i) {
+		void *large = message_queue_message_alloc_blocking(&queue);
+		void *small = message_queue_message_alloc_sized(&queue, 16);
+		message_queue_write(&queue, large);
+		if(small)
+			message_queue_write(&queue, small);
+		for(int j=small ? 2 : 1;j>0;--j) {
+			void *message;
+			while(!(message = message_queue_tryread(&queue)));
+			message_queue_message_free(&queue, message);
+		}
+	}
+	return NULL;
+}
+
+static void *growth_threadproc(void *arg) {
+	void *held[HELD];
+	for(int i=0;i<ROUNDS/10;++i) {
+		int count = 0;
+		while(count < HELD && (held[count] = message_queue_message_alloc(&queue)))
+			++count;
+		CHECK(count > 0);
+		message_queue_message_free_batch(&queue, held, count / 2);
+		for(int j=count/2;j<count;++j) {
+			message_queue_message_free(&queue, held[j]);
+		}
+	}
+	return NULL;
+}
+
+static void run_threads(void *(*threadproc)(void *)) {
+	pthread_t threads[THREADS];
+	for(int i=0;i<THREADS;++i) {
+		CHECK(!pthread_create(&threads[i], NULL, threadproc, NULL));
+	}
+	for(int i=0;i<THREADS;++i) {
+		pthread_join(threads[i], NULL);
+	}
+}
+
+// Everything should be back on the freelists once the caller's magazine is
+static void check_all_free(int depth) {
+	void *held[256];
+	int count = 0;
+	message_queue_magazine_flush(&queue);
+	while(count < depth && (held[count] = message_queue_message_alloc(&queue)))
+		++count;
+	CHECK(count == depth);
+	message_queue_message_free_batch(&queue, held, count);
+}
+
+/*
+ * Allocates everything a growing queue will give out before it reaches its
+ * memory ceiling, then frees it all again. A block lost on the way back from
+ * a magazine shrinks the count.
+ */
+static int count_capacity() {
+	static void *held[4096];
+	int count = 0;
+	while(count < 4096 && (held[count] = message_queue_message_alloc(&queue)))
+		++count;
+	CHECK(count < 4096);
+	message_queue_message_free_batch(&queue, held, count);
+	return count;
+}
+
+static void test_classes() {
+	struct message_queue_size_class classes[] = {{16, 64}, {256, 64}};
+	CHECK(!message_queue_init_classes(&queue, classes, 2));
+	message_queue_enable_magazines(&queue, 8);
+	run_threads(&classes_threadproc);
+	check_all_free(64);
+	// Leave messages in this thread's magazine, then drop it
+	for(int i=0;i<4;++i) {
+		message_queue_message_free(&queue, message_queue_message_alloc(&queue));
+	}
+	message_queue_enable_magazines(&queue, 0);
+	check_all_free(64);
+	message_queue_enable_magazines(&queue, 8);
+	message_queue_message_free(&queue, message_queue_message_alloc(&queue));
+	message_queue_destroy(&queue);
+}
+
+static void test_growth() {
+	int capacity;
+	CHECK(!message_queue_init(&queue, 64, 16));
+	CHECK(!message_queue_enable_growth(&queue, 16 << 10));
+	capacity = count_capacity();
+	CHECK(capacity > 16);
+	message_queue_enable_magazines(&queue, 4);
+	run_threads(&growth_threadproc);
+	for(int i=0;i<4;++i) {
+		message_queue_message_free(&queue, message_queue_message_alloc(&queue));
+	}
+	message_queue_enable_magazines(&queue, 0);
+	CHECK(count_capacity() == capacity);
+	message_queue_enable_magazines(&queue, 4);
+	message_queue_message_free(&queue, message_queue_message_alloc(&queue));
+	message_queue_destroy(&queue);
+}
+
+int main() {
+	test_classes();
+	test_growth();
+	printf("ok\n");
+	return 0;
+}